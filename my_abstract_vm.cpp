@@ -4,16 +4,50 @@
 #include <stack>
 #include <queue>
 #include <string.h>
+#include <string_view>
 #include <vector>
 #include <cstdint>
 #include <typeinfo>
+#include <map>
+#include <functional>
+#include <sstream>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <csignal>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <tuple>
+#include <algorithm>
+#include <type_traits>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
 #define INVALID_TOKEN "<invalid>"
+#define DEFAULT_MAX_STACK_DEPTH 1048576
+#define NBR_INSTRUCTIONS 20
+#define SMALL_INT_MIN -128
+#define SMALL_INT_MAX 1023
+#define MAX_SMALL_INTS 1048576
+#define TRACE_MAGIC "AVMTRACE"
+#define TRACE_RING_SIZE 65536 // must be a power of 2
+#define TRACE_NO_TYPE 0xFF
+#define TRACE_PROGRAM_START 0xFF
+#define NBR_PERF_COUNTERS 6
+#define ANY_TYPE 0xFF
 
 //*************************************** 
 /*
 *  ENUMS
 *    1. eOperandType
 *    2. args_type
+*    3. eOpcode
 *
 ****************************************/
 
@@ -31,17 +65,47 @@ enum args_type {
   FROM_STDIN
 };
 
+/*
+* Same order as instruction_names.
+*/
+enum eOpcode {
+  OP_PUSH,
+  OP_POP,
+  OP_DUMP,
+  OP_ASSERT,
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_MOD,
+  OP_PRINT,
+  OP_EXIT,
+  OP_LABEL,
+  OP_JMP,
+  OP_JZ,
+  OP_JNZ,
+  OP_LOOP,
+  OP_SUM,
+  OP_PROD,
+  OP_MIN,
+  OP_MAX
+};
+
 //*************************************** 
 /*
 *  HELPER FUNCTIONS
 *    1. pretty_print_type
 *    2. get_word
 *    3. split_string
-*    4. check_command
-*    5. check_value
-*    6. is_valid_instruction
-*    7. check_if_program_file
-*    8. mapType
+*    4. get_opcode
+*    5. next_word
+*    6. scan_value
+*    7. scan_label
+*    8. scan_count
+*    9. scan_int
+*   10. check_literal
+*   11. check_if_program_file
+*   12. mapType
 *
 ****************************************/
 
@@ -80,101 +144,195 @@ std::vector<std::string> split_string(const std::string& line, char delim) {
   return split;
 }
 
-std::string check_command(const std::string& str) {
-  std::string result;
-
-  const char *instructions [11] = {"push",
-                                   "pop",
-                                   "dump",
-                                   "assert",
-                                   "add",
-                                   "sub",
-                                   "mul",
-                                   "div",
-                                   "mod",
-                                   "print",
-                                   "exit"};
+const char *instruction_names [NBR_INSTRUCTIONS] = {"push",
+                                                    "pop",
+                                                    "dump",
+                                                    "assert",
+                                                    "add",
+                                                    "sub",
+                                                    "mul",
+                                                    "div",
+                                                    "mod",
+                                                    "print",
+                                                    "exit",
+                                                    "label",
+                                                    "jmp",
+                                                    "jz",
+                                                    "jnz",
+                                                    "loop",
+                                                    "sum",
+                                                    "prod",
+                                                    "min",
+                                                    "max"};
 
-  for (int index = 0; index < 11; index++) {
-    if (!strcmp(str.c_str(), instructions[index])) {
-      return str;
+/*
+* Index of the instruction in instruction_names (used as opcode by the
+* execution trace), or -1 when it is not an instruction.
+*/
+int get_opcode(std::string_view str) {
+  for (int index = 0; index < NBR_INSTRUCTIONS; index++) {
+    if (str == instruction_names[index]) {
+      return index;
     }
   }
 
-  return INVALID_TOKEN;
+  return -1;
 }
 
-std::string check_value(const std::vector<std::string>& split) {
-  std::string value_type;
-  std::string value;
-  std::string result;
+/*
+* Next word of the line starting at pos (spaces, tabs and '\r' separate
+* words), empty at the end of the line. Returns a view on the line.
+*/
+std::string_view next_word(std::string_view line, size_t& pos) {
+  size_t begin;
+
+  while (pos < line.size() && (line[pos] == ' ' || line[pos] == '\t' || line[pos] == '\r')) {
+    pos++;
+  }
+  begin = pos;
+  while (pos < line.size() && line[pos] != ' ' && line[pos] != '\t' && line[pos] != '\r') {
+    pos++;
+  }
+
+  return line.substr(begin, pos - begin);
+}
 
+/*
+* Checks a typed value (ex: "int32(42)"), and appends it to token as
+* "<type index>-<literal>" (ex: "2-42").
+*/
+bool scan_value(std::string_view word, std::string& token) {
   const char *values[5] = {"int8",
                           "int16",
                           "int32",
                           "float",
                           "double"};
+  const char *open = NULL;
+  std::string_view type;
+  std::string_view literal;
+  bool has_digit = false;
+  bool has_dot   = false;
+
+  if (!word.empty()) {
+    open = static_cast<const char *>(memchr(word.data(), '(', word.size()));
+  }
+  if (!open || word.back() != ')') {
+    return false;
+  }
+  type    = word.substr(0, open - word.data());
+  literal = word.substr(type.size() + 1, word.size() - type.size() - 2);
 
-  value_type = get_word(split[1], 0, '(');
-  value      = get_word(split[1], value_type.size(), ' ');
-  
-  for (int index = 0; index < 5; index++) {
-    if (!strcmp(value_type.c_str(), values[index])) {
-      
-      value_type = std::to_string(index);
-      result        = value_type;
-      
-      if (value.c_str()[0] == '(' && value.c_str()[value.size() - 1] == ')') {
+  for (size_t index = 0; index < literal.size(); index++) {
+    if (isdigit(literal[index])) {
+      has_digit = true;
+    }
+    else if (literal[index] == '.' && !has_dot) {
+      has_dot = true;
+    }
+    else if (index != 0 || (literal[index] != '-' && literal[index] != '+')) {
+      return false;
+    }
+  }
+  if (!has_digit) {
+    return false;
+  }
 
-        result      += "-" + value.substr(1, value.size() - 2);
-        return result;
-      }
+  for (int index = 0; index < 5; index++) {
+    if (type == values[index]) {
+      token += static_cast<char>('0' + index);
+      token += '-';
+      token.append(literal);
+      return true;
     }
   }
 
-  return INVALID_TOKEN;
+  return false;
 }
 
-std::string is_valid_instruction(const std::vector<std::string>& split) {
-  std::string result;
-  std::string instr;
-  std::string value;
-
-  if (split.empty()) {
-    return "<blank>";  
+bool scan_label(std::string_view word) {
+  if (word.empty()) {
+    return false;
   }
-  else if (!strcmp(split[0].c_str(), ";;")) {
-    return "<EOP>";
+  for (size_t index = 0; index < word.size(); index++) {
+    if (!isalnum(word[index]) && word[index] != '_') {
+      return false;
+    }
   }
-  else if(!strcmp(split[0].c_str(), ";") || split[0].c_str()[0] == ';') {
-    return "<comment>";
+
+  return true;
+}
+
+bool scan_count(std::string_view word) {
+  if (word.empty() || word.size() > 9) {
+    return false;
   }
-  
-  instr = check_command(split[0]);
-  if (!strcmp(instr.c_str(), INVALID_TOKEN)) {
-    return INVALID_TOKEN;
+  for (size_t index = 0; index < word.size(); index++) {
+    if (!isdigit(word[index])) {
+      return false;
+    }
   }
-  else if (!strcmp(instr.c_str(), "push") ||
-           !strcmp(instr.c_str(), "assert")) {
 
-    value = check_value(split);
+  return word.find_first_not_of('0') != std::string_view::npos;
+}
+
+/*
+* Integer option value: optional '-' and digits, within [min, max].
+*/
+bool scan_int(std::string_view word, int64_t min, int64_t max, int64_t& value) {
+  size_t start = (!word.empty() && word[0] == '-') ? 1 : 0;
 
-    if (strcmp(value.c_str(), INVALID_TOKEN)) {
-      result += instr + "-";
+  if (word.size() == start || word.size() - start > 18) {
+    return false;
+  }
+  value = 0;
+  for (size_t index = start; index < word.size(); index++) {
+    if (!isdigit(word[index])) {
+      return false;
     }
-    result   += value;
+    value = value * 10 + (word[index] - '0');
   }
-  else {
-    result   += instr;
+  if (start) {
+    value = -value;
   }
 
-  if (split.size() > 2) {
-    if (strcmp(split[2].c_str(), ";") && split[2].c_str()[0] != ';') {
-      return INVALID_TOKEN;
+  return value >= min && value <= max;
+}
+
+/*
+* Throws "Overflow"/"Underflow" when a push literal (or a batch input
+* value) does not fit the conversion used for its type.
+*/
+void check_literal(int type, const std::string& value) {
+  try {
+    switch(type) {
+      case 0:
+        std::stoi(value);
+        break;
+      case 1:
+        std::stoi(value);
+        break;
+      case 2:
+        std::stoul(value);
+        break;
+      case 3:
+        std::stof(value);
+        break;
+      case 4:
+        std::stoll(value);
+        break;
     }
   }
-
-  return result;
+  catch(const std::out_of_range& e) {
+    if (value[0] == '-') {
+      throw std::string("Underflow");
+    }
+    else {
+      throw std::string("Overflow");
+    }
+  }
+  catch(const std::invalid_argument& e) {
+    throw std::string("Invalid value: " + value);
+  }
 }
 
 int *check_if_program_file(int ac, char **av) {
@@ -237,11 +395,18 @@ eOperandType mapType(const std::string s_type) {
 /*
 *  CLASSES
 *    1. IOperand
-*    2. Lexer
-*    3. Parser
-*    4. Operand
-*    5. IOperandFactory
-*    6. Executor
+*    2. ConstantPool
+*    3. Lexer
+*    4. Parser
+*    5. Operand
+*    6. SmallOperands
+*    7. IOperandFactory
+*    8. TraceWriter
+*    9. RegisterCompiler
+*   10. Executor
+*   11. ShardPool
+*   12. PerfCounters
+*   13. Scheduler
 *
 ****************************************/
 
@@ -266,6 +431,48 @@ class IOperand
 
 };
 
+/*
+* Integer operation results: shared interned operand for small values,
+* a new Operand otherwise (defined after SmallOperands).
+*/
+IOperand *create_int_operand(eOperandType type, int32_t value);
+
+/*
+* Typed literals of one program, deduplicated and created once at parse
+* time. push and assert refer to them by index, and the operands are
+* shared read-only by every Executor running the program.
+*/
+class ConstantPool {
+  private:
+    std::vector<IOperand *> constants;
+    std::vector<const IOperand *> sorted;
+    std::map<std::string, int> indexes;
+
+  public:
+    ConstantPool() {}
+    ConstantPool(const ConstantPool&) = delete;
+    ConstantPool& operator=(const ConstantPool&) = delete;
+
+    int add(eOperandType type, const std::string& value);
+
+    IOperand *get(int index) const {
+      return this->constants[index];
+    }
+
+    size_t size() const {
+      return this->constants.size();
+    }
+
+    /*
+    * Executors must not free the operands of the pool.
+    */
+    bool contains(const IOperand *operand) const {
+      return std::binary_search(this->sorted.begin(), this->sorted.end(), operand);
+    }
+
+    ~ConstantPool();
+};
+
 class Lexer {
   private:
     std::queue<std::string> LexedQueue;
@@ -273,24 +480,19 @@ class Lexer {
   public:
     /*
     * lex_it for when program is from a file
-    * (converted to a stream)
+    * (read at once, and scanned as a buffer). Read through the stream
+    * buffer, so pipes and FIFOs (/dev/stdin, <(generator)) work too.
     */
     void lex_it(std::ifstream& p_file) {
-      std::string token;
-      std::string line;
+      std::ostringstream buffer;
       this->line_nbr = 0;
 
       LexedQueue.push("<file>");
 
-      while (p_file.good()) {
-        line_nbr++;
-        std::getline(p_file, line);
-        token = tokenize(line);
-        if (!strcmp(token.c_str(), INVALID_TOKEN)) {
-          throw std::string("Invalid instruction: " + line);
-        } 
-        LexedQueue.push(token);
+      if (p_file.good()) {
+        buffer << p_file.rdbuf();
       }
+      lex_lines(buffer.str(), false);
     }
     
     /*
@@ -298,34 +500,115 @@ class Lexer {
     * lex_it for when program is from stdin
     */
     void lex_it(std::string& user_input) {
-      std::string line;
-      std::string token;
-      int index = 0;
       this->line_nbr = 0;
 
       LexedQueue.push("<stdin>");
+      lex_lines(user_input, true);
+    }
+
+    /*
+    * Tokenizes each line of input. A program from stdin ends at its
+    * first empty line.
+    */
+    void lex_lines(std::string_view input, bool stop_at_blank) {
+      const char *newline;
+      size_t begin = 0;
+      size_t end;
+      std::string token;
+
+      while (true) {
+        newline = static_cast<const char *>(memchr(input.data() + begin, '\n', input.size() - begin));
+        end = newline ? newline - input.data() : input.size();
 
-      line = get_word(user_input, index, '\n');
-      while (!line.empty()) {
+        std::string_view line = input.substr(begin, end - begin);
+        if (stop_at_blank && line.empty()) {
+          break;
+        }
+        line_nbr++;
         token = tokenize(line);
         if (!strcmp(token.c_str(), INVALID_TOKEN)) {
-          throw std::string("Invalid instruction: " + line);
+          throw std::string("Invalid instruction: " + std::string(line));
         } 
         LexedQueue.push(token);
 
-        index += line.size() + 1;
-        if (index > (int)user_input.size()) {
+        if (!newline) {
           break;
         }
-        line = get_word(user_input, index, '\n');
+        begin = end + 1;
       }
     }
 
-    std::string tokenize(const std::string& line) {
-      std::vector<std::string> split = split_string(line, ' ');
+    /*
+    * Single pass over the line: recognizes the instruction, and its
+    * value, label or count, without building intermediate strings.
+    */
+    std::string tokenize(std::string_view line) {
       std::string token;
-      
-      token = is_valid_instruction(split);
+      size_t pos = 0;
+      std::string_view word = next_word(line, pos);
+      int opcode;
+
+      if (word.empty()) {
+        return "<blank>";
+      }
+      else if (word == ";;") {
+        return "<EOP>";
+      }
+      else if (word[0] == ';') {
+        return "<comment>";
+      }
+
+      opcode = get_opcode(word);
+      if (opcode == -1) {
+        return INVALID_TOKEN;
+      }
+      token.append(word);
+
+      switch(opcode) {
+        case(OP_PUSH):
+        case(OP_ASSERT):
+          token += '-';
+          if (!scan_value(next_word(line, pos), token)) {
+            return INVALID_TOKEN;
+          }
+          break;
+        case(OP_LABEL):
+        case(OP_JMP):
+        case(OP_JZ):
+        case(OP_JNZ):
+        case(OP_LOOP):
+          word = next_word(line, pos);
+          if (!scan_label(word)) {
+            return INVALID_TOKEN;
+          }
+          token += '-';
+          token.append(word);
+          if (opcode == OP_LOOP) {
+            word = next_word(line, pos);
+            if (!scan_count(word)) {
+              return INVALID_TOKEN;
+            }
+            token += '-';
+            token.append(word);
+          }
+          break;
+        case(OP_SUM):
+        case(OP_PROD):
+        case(OP_MIN):
+        case(OP_MAX):
+          word = next_word(line, pos);
+          if (!scan_count(word)) {
+            return INVALID_TOKEN;
+          }
+          token += '-';
+          token.append(word);
+          break;
+      }
+
+      word = next_word(line, pos);
+      if (!word.empty() && word[0] != ';') {
+        return INVALID_TOKEN;
+      }
 
       return token;    
     }
@@ -349,14 +632,39 @@ class Lexer {
 
 class Parser {
   private:
-    std::queue<std::string> ParsedQueue;
+    std::vector<std::string> ParsedProgram;
+    std::vector<int> simulated_depths;
+    ConstantPool constants;
     int line_nbr;
     int nbr_elements_simulated_stack;
+    int initial_depth;
+    int max_stack_depth;
+    int max_simulated_depth;
   
   public:
+    Parser() : line_nbr(0), nbr_elements_simulated_stack(0), initial_depth(0),
+               max_stack_depth(DEFAULT_MAX_STACK_DEPTH), max_simulated_depth(0) {}
+
+    /*
+    * Programs that could grow the stack past this depth are rejected
+    * before running.
+    */
+    void setMaxStackDepth(int depth) {
+      this->max_stack_depth = depth;
+    }
+
+    /*
+    * Number of elements already on the stack when the program starts
+    * (batch mode preloads each input row before running the program).
+    */
+    void setInitialDepth(int depth) {
+      this->initial_depth = depth;
+    }
+
     void parse_it(std::queue<std::string> LexedQueue) {
       std::string input_type = LexedQueue.front();
       std::string result_status;      
+      std::priority_queue<int, std::vector<int>, std::greater<int> > to_visit;
 
       if (!strcmp(input_type.c_str(), "<stdin>")) {
         if (strcmp(LexedQueue.back().c_str(), "<EOP>")) {
@@ -371,31 +679,165 @@ class Parser {
 
       line_nbr = -1;
       while(!LexedQueue.empty()) {
-        line_nbr++;
-        result_status = simulate_instruction(LexedQueue.front()); 
+        this->ParsedProgram.push_back(LexedQueue.front());
+        LexedQueue.pop();
+      }
+      resolve_labels();
+
+      /*
+      * Walks the program following every branch, so each instruction is
+      * simulated once with the stack depth it is reached with. Merge points
+      * (labels, loop heads) must be reached with the same depth from every
+      * path.
+      */
+      this->simulated_depths.assign(this->ParsedProgram.size(), -1);
+      this->simulated_depths[0] = this->initial_depth;
+      this->max_simulated_depth = this->initial_depth;
+      to_visit.push(0);
+      while (!to_visit.empty()) {
+        int index = to_visit.top();
+        to_visit.pop();
+
+        line_nbr = index;
+        nbr_elements_simulated_stack = this->simulated_depths[index];
+        result_status = simulate_instruction(this->ParsedProgram[index]); 
         if (strcmp(result_status.c_str(), "OK")) {
           throw result_status;
         }
+        if (nbr_elements_simulated_stack > this->max_stack_depth) {
+          throw std::string("Stack depth exceeds maximum of " +
+                            std::to_string(this->max_stack_depth) + " elements");
+        }
+        if (nbr_elements_simulated_stack > this->max_simulated_depth) {
+          this->max_simulated_depth = nbr_elements_simulated_stack;
+        }
 
-        this->ParsedQueue.push(LexedQueue.front());
-        LexedQueue.pop();
+        std::vector<int> next = successors(index);
+        for (size_t succ = 0; succ < next.size(); succ++) {
+          if (next[succ] >= (int)this->ParsedProgram.size()) {
+            continue;
+          }
+          if (this->simulated_depths[next[succ]] == -1) {
+            this->simulated_depths[next[succ]] = nbr_elements_simulated_stack;
+            to_visit.push(next[succ]);
+          }
+          else if (this->simulated_depths[next[succ]] != nbr_elements_simulated_stack) {
+            line_nbr = next[succ];
+            throw std::string("Inconsistent stack depth at merge point (" +
+                              std::to_string(this->simulated_depths[next[succ]]) +
+                              " and " +
+                              std::to_string(nbr_elements_simulated_stack) +
+                              " elements)");
+          }
+        }
+      }
+
+      build_constants();
+    }
+
+    /*
+    * Moves every push/assert literal to the constant pool, and replaces
+    * it in the program by its index (ex: "push-2-42" -> "push-0").
+    */
+    void build_constants() {
+      std::string instr;
+      std::string value;
+      size_t type_pos;
+      size_t value_pos;
+      int constant;
+
+      for (size_t index = 0; index < this->ParsedProgram.size(); index++) {
+        line_nbr = index;
+        instr = get_word(this->ParsedProgram[index], 0, '-');
+        if (strcmp(instr.c_str(), "push") && strcmp(instr.c_str(), "assert")) {
+          continue;
+        }
+        type_pos  = instr.size() + 1;
+        value_pos = this->ParsedProgram[index].find('-', type_pos) + 1;
+        value     = this->ParsedProgram[index].substr(value_pos);
+        try {
+          constant = this->constants.add(mapType(this->ParsedProgram[index].substr(type_pos, value_pos - type_pos - 1)),
+                                         value);
+        }
+        catch(const std::exception& e) {
+          throw std::string("Invalid value: " + value);
+        }
+        this->ParsedProgram[index] = instr + "-" + std::to_string(constant);
+      }
+    }
+
+    /*
+    * Replaces every label name used by jmp/jz/jnz/loop with the index of
+    * its label instruction, so the Executor never searches for targets.
+    */
+    void resolve_labels() {
+      std::map<std::string, int> labels;
+      std::vector<std::string> instruction;
+
+      for (size_t index = 0; index < this->ParsedProgram.size(); index++) {
+        line_nbr = index;
+        instruction = split_string(this->ParsedProgram[index], '-');
+        if (!strcmp(instruction[0].c_str(), "label")) {
+          if (labels.count(instruction[1])) {
+            throw std::string("Duplicate label '" + instruction[1] + "'");
+          }
+          labels[instruction[1]] = index;
+        }
+      }
+
+      for (size_t index = 0; index < this->ParsedProgram.size(); index++) {
+        line_nbr = index;
+        instruction = split_string(this->ParsedProgram[index], '-');
+        if (!strcmp(instruction[0].c_str(), "jmp") ||
+            !strcmp(instruction[0].c_str(), "jz")  ||
+            !strcmp(instruction[0].c_str(), "jnz") ||
+            !strcmp(instruction[0].c_str(), "loop")) {
+          if (!labels.count(instruction[1])) {
+            throw std::string("Undefined label '" + instruction[1] + "'");
+          }
+          this->ParsedProgram[index] = instruction[0] + "-" +
+                                       std::to_string(labels[instruction[1]]);
+          if (instruction.size() > 2) {
+            this->ParsedProgram[index] += "-" + instruction[2];
+          }
+        }
+      }
+    }
+
+    std::vector<int> successors(int index) {
+      std::vector<int> next;
+      std::vector<std::string> instruction = split_string(this->ParsedProgram[index], '-');
+
+      if (!strcmp(instruction[0].c_str(), "exit")) {
+        return next;
+      }
+      if (!strcmp(instruction[0].c_str(), "jmp")) {
+        next.push_back(std::stoi(instruction[1]));
+        return next;
       }
+      if (!strcmp(instruction[0].c_str(), "jz")  ||
+          !strcmp(instruction[0].c_str(), "jnz") ||
+          !strcmp(instruction[0].c_str(), "loop")) {
+        next.push_back(std::stoi(instruction[1]));
+      }
+      next.push_back(index + 1);
+
+      return next;
     }
 
-    std::queue<std::string> getParsedQueue() {
-      return this->ParsedQueue;
+    const std::vector<std::string>& getParsedProgram() {
+      return this->ParsedProgram;
     }
 
     std::string simulate_instruction(const std::string& instr) {
       std::string str;
       std::string result = "OK";
-      std::string type   = split_string(instr, '-')[1];
-      std::string value  = split_string(instr, '-')[2];      
+      std::vector<std::string> split = split_string(instr, '-');
 
-      str = get_word(instr, 0, '-');
-      if (!strcmp(str.c_str(), "pop")    ||
-          !strcmp(str.c_str(), "assert") ||
-          !strcmp(str.c_str(), "print")) {
+      str = split[0];
+      if (!strcmp(str.c_str(), "pop") ||
+          !strcmp(str.c_str(), "jz")  ||
+          !strcmp(str.c_str(), "jnz")) {
         if (nbr_elements_simulated_stack == 0) {
           str[0] = toupper(str[0]);
           result = str + " on empty stack";
@@ -404,6 +846,13 @@ class Parser {
           nbr_elements_simulated_stack--;
         }
       }
+      else if (!strcmp(str.c_str(), "assert") ||
+               !strcmp(str.c_str(), "print")) {
+        if (nbr_elements_simulated_stack == 0) {
+          str[0] = toupper(str[0]);
+          result = str + " on empty stack";
+        }
+      }
       else if (!strcmp(str.c_str(), "add") ||
                !strcmp(str.c_str(), "sub") ||
                !strcmp(str.c_str(), "mul") ||
@@ -417,52 +866,55 @@ class Parser {
           this->nbr_elements_simulated_stack--;
         }
       }
-      else if (!strcmp(str.c_str(), "push")) {
-        try {
-          switch(std::stoi(type)) {
-            case 0:
-              std::stoi(value);
-              break;
-            case 1:
-              std::stoi(value);
-              break;
-            case 2:
-              std::stoul(value);
-              break;
-            case 3:
-              std::stof(value);
-              break;
-            case 4:
-              std::stoll(value);
-              break;
-            }
-           }
-            catch(std::out_of_range e) {
-              if (value[0] == '-') {
-                throw std::string("Underflow");
-              }
-              else {
-                throw std::string("Overflow");
-              }
-            }
-          this->nbr_elements_simulated_stack++;
+      else if (!strcmp(str.c_str(), "sum") ||
+               !strcmp(str.c_str(), "prod") ||
+               !strcmp(str.c_str(), "min") ||
+               !strcmp(str.c_str(), "max")) {
+        int count = std::stoi(split[1]);
+        if (nbr_elements_simulated_stack < count) {
+          str[0] = toupper(str[0]);
+          result = str + " on stack with less then " + split[1] + " operands";
         }
+        else {
+          this->nbr_elements_simulated_stack -= count - 1;
+        }
+      }
+      else if (!strcmp(str.c_str(), "push")) {
+        std::string type   = split[1];
+        std::string value  = instr.substr(instr.find('-', str.size() + 1) + 1);
+
+        check_literal(std::stoi(type), value);
+        this->nbr_elements_simulated_stack++;
+      }
 
 
       return result;
     }
 
     void print_parsed() {
-      std::queue<std::string> ParsedQueue = this->getParsedQueue();
-      while(!ParsedQueue.empty()) {
-        std::cout<< ParsedQueue.front() << std::endl;
-        ParsedQueue.pop();
+      for (size_t index = 0; index < this->ParsedProgram.size(); index++) {
+        std::cout<< this->ParsedProgram[index] << std::endl;
       }
     }
 
     int getLineNbr() {
       return this->line_nbr;
     }
+
+    const ConstantPool& getConstants() {
+      return this->constants;
+    }
+
+    /*
+    * Stack depth before each instruction, -1 when it is unreachable.
+    */
+    const std::vector<int>& getSimulatedDepths() {
+      return this->simulated_depths;
+    }
+
+    int getMaxDepth() {
+      return this->max_simulated_depth;
+    }
 };
 
 template<typename T>
@@ -511,15 +963,15 @@ class Operand : public IOperand {
         case(Int8):
           i8_value = static_cast<int8_t>(this->_value) + 
                     static_cast<int8_t>(std::stoull(rhs.toString()));
-          return new Operand<int8_t>(Int8, i8_value, std::to_string(i8_value));
+          return create_int_operand(Int8, i8_value);
         case(Int16):
           i16_value = static_cast<int16_t>(this->_value) + 
                     static_cast<int16_t>(std::stoull(rhs.toString()));
-          return new Operand<int16_t>(Int16, i16_value, std::to_string(i16_value));
+          return create_int_operand(Int16, i16_value);
         case(Int32):
           i32_value = static_cast<int32_t>(this->_value) + 
                     static_cast<int32_t>(std::stoull(rhs.toString()));
-          return new Operand<int32_t>(Int32, i32_value, std::to_string(i32_value));
+          return create_int_operand(Int32, i32_value);
         case(Float):
           f_value = static_cast<float>(this->_value) + 
                     static_cast<float>(std::stof(rhs.toString()));
@@ -545,15 +997,15 @@ class Operand : public IOperand {
         case(Int8):
           i8_value = static_cast<int8_t>(this->_value) - 
                     static_cast<int8_t>(std::stoull(rhs.toString()));
-          return new Operand<int8_t>(Int8, i8_value, std::to_string(i8_value));
+          return create_int_operand(Int8, i8_value);
         case(Int16):
           i16_value = static_cast<int16_t>(this->_value) - 
                     static_cast<int16_t>(std::stoull(rhs.toString()));
-          return new Operand<int16_t>(Int16, i16_value, std::to_string(i16_value));
+          return create_int_operand(Int16, i16_value);
         case(Int32):
           i32_value = static_cast<int32_t>(this->_value) - 
                     static_cast<int32_t>(std::stoull(rhs.toString()));
-          return new Operand<int32_t>(Int32, i32_value, std::to_string(i32_value));
+          return create_int_operand(Int32, i32_value);
         case(Float):
           f_value = static_cast<float>(this->_value) -
                     static_cast<float>(std::stof(rhs.toString()));
@@ -580,15 +1032,15 @@ class Operand : public IOperand {
         case(Int8):
           i8_value = static_cast<int8_t>(this->_value) * 
                     static_cast<int8_t>(std::stoull(rhs.toString()));
-          return new Operand<int8_t>(Int8, i8_value, std::to_string(i8_value));
+          return create_int_operand(Int8, i8_value);
         case(Int16):
           i16_value = static_cast<int16_t>(this->_value) * 
                     static_cast<int16_t>(std::stoull(rhs.toString()));
-          return new Operand<int16_t>(Int16, i16_value, std::to_string(i16_value));
+          return create_int_operand(Int16, i16_value);
         case(Int32):
           i32_value = static_cast<int32_t>(this->_value) * 
                     static_cast<int32_t>(std::stoull(rhs.toString()));
-          return new Operand<int32_t>(Int32, i32_value, std::to_string(i32_value));
+          return create_int_operand(Int32, i32_value);
         case(Float):
           f_value = static_cast<float>(this->_value) *
                     static_cast<float>(std::stof(rhs.toString()));
@@ -620,15 +1072,15 @@ class Operand : public IOperand {
         case(Int8):
           i8_value = static_cast<int8_t>(this->_value) / 
                     static_cast<int8_t>(std::stoull(rhs.toString()));
-          return new Operand<int8_t>(Int8, i8_value, std::to_string(i8_value));
+          return create_int_operand(Int8, i8_value);
         case(Int16):
           i16_value = static_cast<int16_t>(this->_value) / 
                     static_cast<int16_t>(std::stoull(rhs.toString()));
-          return new Operand<int16_t>(Int16, i16_value, std::to_string(i16_value));
+          return create_int_operand(Int16, i16_value);
         case(Int32):
           i32_value = static_cast<int32_t>(this->_value) / 
                     static_cast<int32_t>(std::stoull(rhs.toString()));
-          return new Operand<int32_t>(Int32, i32_value, std::to_string(i32_value));
+          return create_int_operand(Int32, i32_value);
         case(Float):
           f_value = static_cast<float>(this->_value) /
                     static_cast<float>(std::stof(rhs.toString()));
@@ -659,15 +1111,15 @@ class Operand : public IOperand {
         case(Int8):
           i8_value = static_cast<int8_t>(this->_value) %
                     static_cast<int8_t>(std::stoull(rhs.toString()));
-          return new Operand<int8_t>(Int8, i8_value, std::to_string(i8_value));
+          return create_int_operand(Int8, i8_value);
         case(Int16):
           i16_value = static_cast<int16_t>(this->_value) % 
                     static_cast<int16_t>(std::stoull(rhs.toString()));
-          return new Operand<int16_t>(Int16, i16_value, std::to_string(i16_value));
+          return create_int_operand(Int16, i16_value);
         case(Int32):
           i32_value = static_cast<int32_t>(this->_value) % 
                     static_cast<int32_t>(std::stoull(rhs.toString()));
-          return new Operand<int32_t>(Int32, i32_value, std::to_string(i32_value));
+          return create_int_operand(Int32, i32_value);
         case(Float):
           f_value = static_cast<float>(static_cast<int32_t>(this->_value) % 
                     static_cast<int32_t>(std::stoull(rhs.toString())));
@@ -685,16 +1137,129 @@ class Operand : public IOperand {
 };
 
 
+/*
+* Preallocated, immutable operands shared by every program: all 256 Int8
+* values, and Int16/Int32 values in a configurable range of small ints.
+* They are never deleted; is_interned() tells them apart from owned ones.
+*/
+class SmallOperands {
+  private:
+    std::vector<Operand<int8_t> > int8_values;
+    std::vector<Operand<int16_t> > int16_values;
+    std::vector<Operand<int32_t> > int32_values;
+    int int16_first;
+    int int32_first;
+
+    static std::pair<int, int>& range() {
+      static std::pair<int, int> small_range(SMALL_INT_MIN, SMALL_INT_MAX);
+      return small_range;
+    }
+
+    SmallOperands() {
+      int first = range().first;
+      int last  = range().second;
+
+      for (int value = INT8_MIN; value <= INT8_MAX; value++) {
+        this->int8_values.push_back(Operand<int8_t>(Int8, value, std::to_string(value)));
+      }
+      this->int16_first = std::max(first, INT16_MIN);
+      for (int value = this->int16_first; value <= std::min(last, INT16_MAX); value++) {
+        this->int16_values.push_back(Operand<int16_t>(Int16, value, std::to_string(value)));
+      }
+      this->int32_first = first;
+      for (int64_t value = first; value <= last; value++) {
+        this->int32_values.push_back(Operand<int32_t>(Int32, value, std::to_string(value)));
+      }
+    }
+
+    template<typename T>
+    static bool in(const std::vector<Operand<T> >& values, const IOperand *operand) {
+      return !values.empty() &&
+             operand >= &values.front() && operand <= &values.back();
+    }
+
+  public:
+    /*
+    * Must be called before the first operand is created.
+    */
+    static void setRange(int first, int last) {
+      range() = std::make_pair(first, last);
+    }
+
+    static SmallOperands& instance() {
+      static SmallOperands table;
+      return table;
+    }
+
+    IOperand *find(eOperandType type, int32_t value) {
+      switch(type) {
+        case(Int8):
+          return &this->int8_values[value - INT8_MIN];
+        case(Int16):
+          if (value >= this->int16_first &&
+              value - this->int16_first < (int32_t)this->int16_values.size()) {
+            return &this->int16_values[value - this->int16_first];
+          }
+          break;
+        case(Int32):
+          if (value >= this->int32_first &&
+              (int64_t)value - this->int32_first < (int64_t)this->int32_values.size()) {
+            return &this->int32_values[value - this->int32_first];
+          }
+          break;
+        default:
+          break;
+      }
+      return NULL;
+    }
+
+    bool is_interned(const IOperand *operand) const {
+      return in(this->int8_values, operand) ||
+             in(this->int16_values, operand) ||
+             in(this->int32_values, operand);
+    }
+};
+
+IOperand *create_int_operand(eOperandType type, int32_t value) {
+  IOperand *operand = SmallOperands::instance().find(type, value);
+
+  if (operand) {
+    return operand;
+  }
+  if (type == Int16) {
+    return new Operand<int16_t>(Int16, value, std::to_string(value));
+  }
+  return new Operand<int32_t>(Int32, value, std::to_string(value));
+}
+
 class IOperandFactory {
+  private:
+    /*
+    * Literals written the way the VM prints them (ex: "42", not "042")
+    * use the interned operand.
+    */
+    template<typename T>
+    IOperand * createInt(eOperandType type, const std::string & value) {
+      T t_value = std::stoull(value);
+
+      if (!strcmp(std::to_string(t_value).c_str(), value.c_str())) {
+        IOperand *operand = SmallOperands::instance().find(type, t_value);
+        if (operand) {
+          return operand;
+        }
+      }
+      return new Operand<T>(type, t_value, value);
+    }
+
   public:
     IOperand * createInt8(const std::string & value) {
-      return new Operand<int8_t>(Int8, std::stoull(value), value);
+      return createInt<int8_t>(Int8, value);
     }
     IOperand * createInt16(const std::string & value) {
-      return new Operand<int16_t>(Int16, std::stoull(value), value);
+      return createInt<int16_t>(Int16, value);
     }
     IOperand * createInt32(const std::string & value) {
-      return new Operand<int32_t>(Int32, std::stoull(value), value);
+      return createInt<int32_t>(Int32, value);
     }
     IOperand * createFloat(const std::string & value) {
       return new Operand<float>(Float, std::stof(value), value);
@@ -718,162 +1283,2609 @@ class IOperandFactory {
     ~IOperandFactory(){}
 };
 
-class Executor {
-  private:
-    std::stack<IOperand *> stack_container;
-    IOperandFactory factory;
-    int line_nbr;
-  public:
+int ConstantPool::add(eOperandType type, const std::string& value) {
+  IOperandFactory factory;
+  std::string key = std::to_string(type) + "-" + value;
+  std::map<std::string, int>::iterator found = this->indexes.find(key);
 
-     void execute_it (std::queue<std::string> ParsedQueue) {
-       std::vector<std::string> instruction;
-       this->line_nbr = 0;
+  if (found != this->indexes.end()) {
+    return found->second;
+  }
+  this->constants.push_back(factory.createOperand(type, value));
+  this->sorted.insert(std::lower_bound(this->sorted.begin(), this->sorted.end(),
+                                       this->constants.back()), this->constants.back());
+  this->indexes[key] = this->constants.size() - 1;
 
-       while(!ParsedQueue.empty()) {
-         this->line_nbr++;
-         instruction = split_string(ParsedQueue.front(), '-');
-         if (!strcmp(instruction[0].c_str(), "push")) {
-           Executor::push_it(instruction[1], instruction[2]);
-         }
-         else if (!strcmp(instruction[0].c_str(), "pop")) {
-           Executor::pop_it();
-         }
-         else if (!strcmp(instruction[0].c_str(), "dump")) {
-           Executor::dump_it();
-         }
-         else if (!strcmp(instruction[0].c_str(), "assert")) {
-           Executor::assert_it(instruction[1], instruction[2]);
-         }
-         else if (!strcmp(instruction[0].c_str(), "add")) {
-           IOperand *v1 = this->stack_container.top();
-           this->stack_container.pop();
-           IOperand *v2 = this->stack_container.top();
-           this->stack_container.pop();
+  return this->constants.size() - 1;
+}
 
-           this->stack_container.push(*v2 + *v1);
-         }
-         else if (!strcmp(instruction[0].c_str(), "sub")) {
-           IOperand *v1 = this->stack_container.top();
-           this->stack_container.pop();
-           IOperand *v2 = this->stack_container.top();
-           this->stack_container.pop();
+ConstantPool::~ConstantPool() {
+  for (size_t index = 0; index < this->constants.size(); index++) {
+    if (!SmallOperands::instance().is_interned(this->constants[index])) {
+      delete this->constants[index];
+    }
+  }
+}
 
-           this->stack_container.push(*v2 - *v1);
-         }
-         else if (!strcmp(instruction[0].c_str(), "mul")) {
-           IOperand *v1 = this->stack_container.top();
-           this->stack_container.pop();
-           IOperand *v2 = this->stack_container.top();
-           this->stack_container.pop();
+/*
+* Native value of an operand, without going through its string.
+*/
+double operand_value(const IOperand *operand) {
+  switch(operand->getType()) {
+    case(Int8):
+      return static_cast<const Operand<int8_t> *>(operand)->getValue();
+    case(Int16):
+      return static_cast<const Operand<int16_t> *>(operand)->getValue();
+    case(Int32):
+      return static_cast<const Operand<int32_t> *>(operand)->getValue();
+    case(Float):
+      return static_cast<const Operand<float> *>(operand)->getValue();
+    case(Double):
+      return static_cast<const Operand<double> *>(operand)->getValue();
+  }
+  return 0;
+}
 
-           this->stack_container.push(*v2 * *v1);
-         }
-         else if (!strcmp(instruction[0].c_str(), "div")) {
-           IOperand *v1 = this->stack_container.top();
-           if (std::stoull(v1->toString()) == 0 ||
-               std::stof(v1->toString()) == 0 || 
-               std::stod(v1->toString()) == 0) {
-             throw std::string("Division by zero."); 
-           }
-           this->stack_container.pop();
-           IOperand *v2 = this->stack_container.top();
-           this->stack_container.pop();
+/*
+* One executed instruction, as written to the trace file.
+* Types are eOperandType values, or TRACE_NO_TYPE.
+*/
+struct TraceRecord {
+  uint32_t ip;
+  uint32_t depth;
+  uint8_t  opcode;
+  uint8_t  lhs_type;
+  uint8_t  rhs_type;
+  uint8_t  result_type;
+  uint32_t pad;
+  double   result;
+};
 
-           this->stack_container.push(*v2 / *v1);
-         }
-         else if (!strcmp(instruction[0].c_str(), "mod")) {
-           IOperand *v1 = this->stack_container.top();
-           if (std::stoull(v1->toString()) == 0 ||
-               std::stof(v1->toString()) == 0 || 
-               std::stod(v1->toString()) == 0) {
-             throw std::string("Mod division by zero.");
-           }
-           this->stack_container.pop();
-           IOperand *v2 = this->stack_container.top();
-           this->stack_container.pop();
+/*
+* Collects TraceRecords in a single-producer/single-consumer lock-free ring.
+* The Executor only copies the record into the ring; a background thread
+* flushes it to the trace file. When the ring is full the Executor waits
+* for the flusher, so no record is ever dropped.
+*/
+class TraceWriter {
+  private:
+    std::vector<TraceRecord> ring;
+    alignas(64) std::atomic<size_t> head;
+    size_t cached_tail;
+    alignas(64) std::atomic<size_t> tail;
+    std::atomic<bool> done;
+    std::ofstream file;
+    std::thread flusher;
+
+    void flush_loop() {
+      while (true) {
+        size_t first = this->tail.load(std::memory_order_relaxed);
+        size_t last  = this->head.load(std::memory_order_acquire);
+
+        if (first == last) {
+          if (this->done.load(std::memory_order_acquire) &&
+              last == this->head.load(std::memory_order_acquire)) {
+            break;
+          }
+          std::this_thread::sleep_for(std::chrono::microseconds(200));
+          continue;
+        }
+        while (first != last) {
+          size_t begin = first & (this->ring.size() - 1);
+          size_t count = std::min(last - first, this->ring.size() - begin);
+          this->file.write(reinterpret_cast<const char *>(&this->ring[begin]),
+                           count * sizeof(TraceRecord));
+          first += count;
+        }
+        this->tail.store(last, std::memory_order_release);
+      }
+      this->file.flush();
+    }
+
+  public:
+    TraceWriter(const std::string& path)
+        : ring(TRACE_RING_SIZE), head(0), cached_tail(0), tail(0), done(false),
+          file(path.c_str(), std::ios::binary | std::ios::trunc) {
+      uint32_t record_size = sizeof(TraceRecord);
+
+      if (!this->file.good()) {
+        throw std::string("Cannot open trace file: " + path);
+      }
+      this->file.write(TRACE_MAGIC, 8);
+      this->file.write(reinterpret_cast<const char *>(&record_size), sizeof(record_size));
+      this->flusher = std::thread(&TraceWriter::flush_loop, this);
+    }
+
+    void record(const TraceRecord& record) {
+      size_t position = this->head.load(std::memory_order_relaxed);
+
+      // The flusher's tail is only read again when the ring looks full.
+      while (position - this->cached_tail == this->ring.size()) {
+        this->cached_tail = this->tail.load(std::memory_order_acquire);
+        if (position - this->cached_tail == this->ring.size()) {
+          std::this_thread::yield();
+        }
+      }
+      this->ring[position & (this->ring.size() - 1)] = record;
+      this->head.store(position + 1, std::memory_order_release);
+    }
+
+    /*
+    * Marks the start of a new program, replay starts again from an empty stack.
+    */
+    void start_program(uint32_t program_nbr) {
+      TraceRecord marker = {program_nbr, 0, TRACE_PROGRAM_START,
+                            TRACE_NO_TYPE, TRACE_NO_TYPE, TRACE_NO_TYPE, 0, 0};
+      record(marker);
+    }
+
+    ~TraceWriter() {
+      this->done.store(true, std::memory_order_release);
+      this->flusher.join();
+    }
+};
+
+/*
+* Type the reduction kernels accumulate in: unsigned for integers, so
+* overflow wraps.
+*/
+template<typename T, bool = std::is_integral<T>::value>
+struct wrapping {
+  typedef T type;
+};
+
+template<typename T>
+struct wrapping<T, true> {
+  typedef typename std::make_unsigned<T>::type type;
+};
+
+/*
+* Register IR: each stack slot is a virtual register, so operations name
+* their operands (ex: "r1 = r1 + r2") and push/pop turn into plain
+* register writes. type is the statically known result type of an
+* operation, or ANY_TYPE when it depends on the path taken.
+*/
+struct RegInstruction {
+  uint8_t op;
+  uint8_t type;
+  int32_t dst;
+  int32_t lhs;
+  int32_t rhs;
+  int32_t arg;
+  int32_t line;
+};
+
+struct RegisterProgram {
+  std::vector<RegInstruction> code;
+  int nbr_registers;
+  int nbr_loops;
+};
+
+/*
+* Translates a parsed program to the register IR, using the stack depth the
+* Parser simulated before each instruction:
+*   push c -> r[d] = c         add -> r[d-2] = r[d-2] + r[d-1]
+*   pop    -> (nothing)        dump -> dump r[0..d-1]
+* Jump targets become IR indices, and unreachable instructions are dropped.
+* Then operation types are inferred, and values that are never read are
+* eliminated (pushes and add/sub/mul results; div and mod may fail, and are
+* kept).
+*/
+class RegisterCompiler {
+  private:
+    const std::vector<std::string>& program;
+    const std::vector<int>& depths;
+    const ConstantPool& constants;
+    RegisterProgram result;
+    std::vector<int> depth_before;
+
+    static bool is_branch(uint8_t op) {
+      return op == OP_JMP || op == OP_JZ || op == OP_JNZ || op == OP_LOOP || op == OP_EXIT;
+    }
+
+    static bool is_operation(uint8_t op) {
+      return op >= OP_ADD && op <= OP_MOD;
+    }
+
+    static bool is_reduction(uint8_t op) {
+      return op >= OP_SUM && op <= OP_MAX;
+    }
+
+    void translate() {
+      std::vector<int> ir_index(this->program.size() + 1, 0);
+      std::vector<std::string> instruction;
+
+      for (size_t index = 0; index < this->program.size(); index++) {
+        int depth = this->depths[index];
+        int opcode;
+        RegInstruction ins = {0, ANY_TYPE, -1, -1, -1, -1, (int32_t)index};
+
+        ir_index[index] = this->result.code.size();
+        if (depth < 0) {
+          continue;
+        }
+        instruction = split_string(this->program[index], '-');
+        opcode = get_opcode(instruction[0]);
+        ins.op = opcode;
+        switch(opcode) {
+          case(OP_PUSH):
+            ins.dst = depth;
+            ins.arg = std::stoi(instruction[1]);
+            ins.type = this->constants.get(ins.arg)->getType();
+            break;
+          case(OP_ADD):
+          case(OP_SUB):
+          case(OP_MUL):
+          case(OP_DIV):
+          case(OP_MOD):
+            ins.dst = depth - 2;
+            ins.lhs = depth - 2;
+            ins.rhs = depth - 1;
+            break;
+          case(OP_DUMP):
+            ins.lhs = depth;
+            break;
+          case(OP_ASSERT):
+            ins.lhs = depth - 1;
+            ins.arg = std::stoi(instruction[1]);
+            break;
+          case(OP_PRINT):
+          case(OP_JZ):
+          case(OP_JNZ):
+            ins.lhs = depth - 1;
+            ins.arg = (opcode == OP_PRINT) ? -1 : std::stoi(instruction[1]);
+            break;
+          case(OP_JMP):
+            ins.arg = std::stoi(instruction[1]);
+            break;
+          case(OP_LOOP):
+            ins.lhs = this->result.nbr_loops++;
+            ins.rhs = std::stoi(instruction[2]);
+            ins.arg = std::stoi(instruction[1]);
+            break;
+          case(OP_SUM):
+          case(OP_PROD):
+          case(OP_MIN):
+          case(OP_MAX):
+            ins.rhs = std::stoi(instruction[1]);
+            ins.dst = depth - ins.rhs;
+            ins.lhs = depth - ins.rhs;
+            break;
+          case(OP_EXIT):
+            break;
+          default:
+            continue;
+        }
+        this->result.code.push_back(ins);
+        this->depth_before.push_back(depth);
+      }
+      ir_index[this->program.size()] = this->result.code.size();
+
+      for (size_t index = 0; index < this->result.code.size(); index++) {
+        RegInstruction& ins = this->result.code[index];
+        if (is_branch(ins.op) && ins.op != OP_EXIT) {
+          ins.arg = ir_index[ins.arg];
+        }
+      }
+    }
+
+    static bool merge_types(std::vector<uint8_t>& into, const std::vector<uint8_t>& from) {
+      bool changed = false;
+
+      if (into.empty() && !from.empty()) {
+        into = from;
+        return true;
+      }
+      for (size_t reg = 0; reg < into.size(); reg++) {
+        if (into[reg] != from[reg] && into[reg] != ANY_TYPE) {
+          into[reg] = ANY_TYPE;
+          changed = true;
+        }
+      }
+      return changed;
+    }
+
+    /*
+    * Forward pass over the IR, repeated until the register types known at
+    * each jump target no longer change (loops).
+    */
+    void infer_types(int initial_depth) {
+      std::map<int, std::vector<uint8_t> > at_target;
+      std::vector<uint8_t> types;
+      bool changed = true;
+
+      for (size_t index = 0; index < this->result.code.size(); index++) {
+        if (is_branch(this->result.code[index].op) && this->result.code[index].op != OP_EXIT) {
+          at_target[this->result.code[index].arg];
+        }
+      }
+
+      while (changed) {
+        bool reachable = true;
+        changed = false;
+        types.assign(initial_depth, ANY_TYPE);
+
+        for (size_t index = 0; index < this->result.code.size(); index++) {
+          RegInstruction& ins = this->result.code[index];
+          std::map<int, std::vector<uint8_t> >::iterator target = at_target.find(index);
+
+          if (target != at_target.end()) {
+            if (target->second.empty() && this->depth_before[index] > 0) {
+              target->second = reachable ? types
+                                         : std::vector<uint8_t>(this->depth_before[index], ANY_TYPE);
+            }
+            else if (reachable) {
+              changed |= merge_types(target->second, types);
+            }
+            types = target->second;
+          }
+          types.resize(this->depth_before[index], ANY_TYPE);
+          reachable = true;
+
+          switch(ins.op) {
+            case(OP_PUSH):
+              types.push_back(ins.type);
+              break;
+            case(OP_ADD):
+            case(OP_SUB):
+            case(OP_MUL):
+            case(OP_DIV):
+            case(OP_MOD):
+              ins.type = (types[ins.lhs] == ANY_TYPE || types[ins.rhs] == ANY_TYPE)
+                         ? ANY_TYPE : std::max(types[ins.lhs], types[ins.rhs]);
+              types.pop_back();
+              types.back() = ins.type;
+              break;
+            case(OP_SUM):
+            case(OP_PROD):
+            case(OP_MIN):
+            case(OP_MAX):
+              ins.type = types[ins.lhs];
+              for (int reg = ins.lhs; reg < ins.lhs + ins.rhs; reg++) {
+                if (types[reg] == ANY_TYPE || ins.type == ANY_TYPE) {
+                  ins.type = ANY_TYPE;
+                }
+                else {
+                  ins.type = std::max(ins.type, types[reg]);
+                }
+              }
+              types.resize(ins.lhs);
+              types.push_back(ins.type);
+              break;
+            case(OP_JZ):
+            case(OP_JNZ):
+              types.pop_back();
+              break;
+          }
+          if (is_branch(ins.op) && ins.op != OP_EXIT) {
+            changed |= merge_types(at_target[ins.arg], types);
+          }
+          if (ins.op == OP_JMP || ins.op == OP_EXIT) {
+            reachable = false;
+          }
+        }
+      }
+    }
+
+    int depth_after(size_t index) {
+      return index + 1 < this->depth_before.size() ? this->depth_before[index + 1] : 0;
+    }
+
+    /*
+    * Backward pass removing the definitions of registers that are
+    * overwritten or dropped before being read. At the end of each block
+    * every register below the stack depth is considered live, so the pass
+    * stays linear.
+    */
+    void eliminate_dead_values() {
+      std::vector<bool> is_target(this->result.code.size() + 1, false);
+      std::vector<bool> removed(this->result.code.size(), false);
+      std::vector<unsigned> stamp(this->result.nbr_registers + 1, 0);
+      std::vector<bool> live(this->result.nbr_registers + 1, false);
+      std::vector<int> new_index(this->result.code.size() + 1, 0);
+      std::vector<RegInstruction> code;
+      std::vector<int> depths;
+      unsigned generation = 1;
+      int floor = 0;
+
+      for (size_t index = 0; index < this->result.code.size(); index++) {
+        if (is_branch(this->result.code[index].op) && this->result.code[index].op != OP_EXIT) {
+          is_target[this->result.code[index].arg] = true;
+        }
+      }
+
+      for (size_t index = this->result.code.size(); index-- > 0; ) {
+        RegInstruction& ins = this->result.code[index];
+
+        if (ins.op == OP_EXIT || index + 1 == this->result.code.size()) {
+          floor = 0;
+          generation++;
+        }
+        else if (is_branch(ins.op) || is_target[index + 1]) {
+          floor = (ins.op == OP_JMP) ? this->depth_before[index] : depth_after(index);
+          // jz/jnz/loop also continue at their target: registers live there stay live.
+          if (is_branch(ins.op) && ins.op != OP_JMP) {
+            floor = std::max(floor, ins.arg < (int)this->depth_before.size()
+                                    ? this->depth_before[ins.arg] : 0);
+          }
+          generation++;
+        }
+        #define IS_LIVE(reg) (stamp[reg] == generation ? live[reg] : (reg) < floor)
+        #define SET_LIVE(reg, value) (stamp[reg] = generation, live[reg] = (value))
+
+        if ((ins.op == OP_PUSH || ins.op == OP_ADD || ins.op == OP_SUB || ins.op == OP_MUL ||
+             is_reduction(ins.op)) &&
+            !IS_LIVE(ins.dst)) {
+          removed[index] = true;
+          continue;
+        }
+        if (ins.dst != -1) {
+          SET_LIVE(ins.dst, false);
+        }
+        if (is_operation(ins.op)) {
+          SET_LIVE(ins.lhs, true);
+          SET_LIVE(ins.rhs, true);
+        }
+        else if (ins.op == OP_DUMP) {
+          for (int reg = 0; reg < ins.lhs; reg++) {
+            SET_LIVE(reg, true);
+          }
+        }
+        else if (is_reduction(ins.op)) {
+          for (int reg = ins.lhs; reg < ins.lhs + ins.rhs; reg++) {
+            SET_LIVE(reg, true);
+          }
+        }
+        else if (ins.lhs != -1 && ins.op != OP_LOOP) {
+          SET_LIVE(ins.lhs, true);
+        }
+        #undef IS_LIVE
+        #undef SET_LIVE
+      }
+
+      for (size_t index = 0; index < this->result.code.size(); index++) {
+        new_index[index] = code.size();
+        if (!removed[index]) {
+          code.push_back(this->result.code[index]);
+          depths.push_back(this->depth_before[index]);
+        }
+      }
+      new_index[this->result.code.size()] = code.size();
+      for (size_t index = 0; index < code.size(); index++) {
+        if (is_branch(code[index].op) && code[index].op != OP_EXIT) {
+          code[index].arg = new_index[code[index].arg];
+        }
+      }
+      this->result.code.swap(code);
+      this->depth_before.swap(depths);
+    }
+
+  public:
+    RegisterCompiler(const std::vector<std::string>& parsed_program,
+                     const std::vector<int>& simulated_depths,
+                     const ConstantPool& pool)
+        : program(parsed_program), depths(simulated_depths), constants(pool) {}
+
+    RegisterProgram compile(int max_depth, int initial_depth = 0) {
+      this->result.code.clear();
+      this->result.nbr_registers = max_depth;
+      this->result.nbr_loops = 0;
+      this->depth_before.clear();
+
+      translate();
+      infer_types(initial_depth);
+      eliminate_dead_values();
+
+      return this->result;
+    }
+
+    static void print_ir(const RegisterProgram& program) {
+      const char *types[5] = {"int8", "int16", "int32", "float", "double"};
+
+      for (size_t index = 0; index < program.code.size(); index++) {
+        const RegInstruction& ins = program.code[index];
+        std::cout << index << "\t(line " << ins.line << ")\t";
+        switch(ins.op) {
+          case(OP_PUSH):
+            std::cout << "r" << ins.dst << " = #" << ins.arg;
+            break;
+          case(OP_ADD):
+          case(OP_SUB):
+          case(OP_MUL):
+          case(OP_DIV):
+          case(OP_MOD):
+            std::cout << "r" << ins.dst << " = " << instruction_names[ins.op]
+                      << "." << (ins.type == ANY_TYPE ? "any" : types[ins.type])
+                      << " r" << ins.lhs << ", r" << ins.rhs;
+            break;
+          case(OP_DUMP):
+            std::cout << "dump r0..r" << ins.lhs - 1;
+            break;
+          case(OP_SUM):
+          case(OP_PROD):
+          case(OP_MIN):
+          case(OP_MAX):
+            std::cout << "r" << ins.dst << " = " << instruction_names[ins.op]
+                      << "." << (ins.type == ANY_TYPE ? "any" : types[ins.type])
+                      << " r" << ins.lhs << "..r" << ins.lhs + ins.rhs - 1;
+            break;
+          case(OP_ASSERT):
+            std::cout << "assert r" << ins.lhs << " == #" << ins.arg;
+            break;
+          case(OP_PRINT):
+            std::cout << "print r" << ins.lhs;
+            break;
+          case(OP_JZ):
+          case(OP_JNZ):
+            std::cout << instruction_names[ins.op] << " r" << ins.lhs << ", " << ins.arg;
+            break;
+          case(OP_JMP):
+            std::cout << "jmp " << ins.arg;
+            break;
+          case(OP_LOOP):
+            std::cout << "loop " << ins.arg << " x" << ins.rhs;
+            break;
+          case(OP_EXIT):
+            std::cout << "exit";
+            break;
+        }
+        std::cout << std::endl;
+      }
+    }
+};
+
+class Executor {
+  private:
+    /*
+    * Stack whose element under the top can be read, so tracing does not
+    * pop and push back the top of the stack.
+    */
+    class OperandStack : public std::stack<IOperand *, std::vector<IOperand *> > {
+      public:
+        using std::stack<IOperand *, std::vector<IOperand *> >::stack;
+
+        IOperand *below_top() const {
+          return this->c[this->c.size() - 2];
+        }
+
+        IOperand * const *top_slots(int count) const {
+          return &this->c[this->c.size() - count];
+        }
+    };
+
+    OperandStack stack_container;
+    std::vector<IOperand *> registers;
+    std::tuple<std::vector<int8_t>, std::vector<int16_t>, std::vector<int32_t>,
+               std::vector<float>, std::vector<double> > scratch_buffers;
+    IOperandFactory factory;
+    const ConstantPool *constants;
+    std::ostream *out;
+    TraceWriter *tracer;
+    const std::vector<std::string> *program;
+    std::vector<int> loop_counters;
+    size_t ip;
+    uint64_t nbr_executed;
+    int line_nbr;
+
+    /*
+    * Operands created while executing belong to the stack slot (or the
+    * register) holding them, and are freed once popped, consumed by an
+    * operation or overwritten, so live operands never outnumber the stack
+    * depth. Constant pool and interned operands are shared, never freed.
+    */
+    void release(IOperand *operand) {
+      if (operand && !SmallOperands::instance().is_interned(operand) &&
+          !(this->constants && this->constants->contains(operand))) {
+        delete operand;
+      }
+    }
+
+    /*
+    * Replaces the count operands on top of the stack by the result of
+    * their operation. They are only popped once the result exists, so
+    * after an error they are still released by reset().
+    */
+    void replace_top(int count, IOperand *result) {
+      for (int index = 0; index < count; index++) {
+        if (this->stack_container.top() != result) {
+          release(this->stack_container.top());
+        }
+        this->stack_container.pop();
+      }
+      this->stack_container.push(result);
+    }
+
+  public:
+    /*
+    * Operand types of the two elements on top of the stack, before an
+    * instruction runs (rhs is the top one).
+    */
+    void trace_operands(TraceRecord& record) {
+      record.lhs_type = TRACE_NO_TYPE;
+      record.rhs_type = TRACE_NO_TYPE;
+      if (this->stack_container.empty()) {
+        return;
+      }
+      record.rhs_type = this->stack_container.top()->getType();
+      if (this->stack_container.size() > 1) {
+        record.lhs_type = this->stack_container.below_top()->getType();
+      }
+    }
+
+    /*
+    * Result is the element left on top by instructions that push one.
+    */
+    void trace_result(TraceRecord& record) {
+      record.depth = this->stack_container.size();
+      record.result_type = TRACE_NO_TYPE;
+      record.result = 0;
+      if (record.opcode == OP_PUSH ||
+          (record.opcode >= OP_ADD && record.opcode <= OP_MOD) ||
+          (record.opcode >= OP_SUM && record.opcode <= OP_MAX)) {
+        record.result_type = this->stack_container.top()->getType();
+        record.result = operand_value(this->stack_container.top());
+      }
+      this->tracer->record(record);
+    }
+
+  public:
+    Executor() : constants(NULL), out(&std::cout), tracer(NULL), program(NULL),
+                 ip(0), nbr_executed(0), line_nbr(0) {}
+
+    void setConstants(const ConstantPool& pool) {
+      this->constants = &pool;
+    }
+
+    void setOutput(std::ostream& output) {
+      this->out = &output;
+    }
+
+    void setTrace(TraceWriter *trace) {
+      this->tracer = trace;
+    }
+
+    void reset() {
+      while (!this->stack_container.empty()) {
+        release(this->stack_container.top());
+        this->stack_container.pop();
+      }
+      for (size_t index = 0; index < this->registers.size(); index++) {
+        release(this->registers[index]);
+        this->registers[index] = NULL;
+      }
+    }
+
+    /*
+    * Sizes the stack from the Parser's simulation, so running the program
+    * does not reallocate it. It keeps its capacity across reset(). Since
+    * operands are freed once off the stack, at most max_depth of them are
+    * alive at once (operation results are still allocated by Operand).
+    */
+    void reserve(size_t max_depth) {
+      std::vector<IOperand *> storage;
+
+      storage.reserve(max_depth);
+      this->stack_container = OperandStack(std::move(storage));
+    }
+
+    /*
+    * Pushes the initial stack values of a batch input row
+    * (ex: "int32(42),float(1.5)"), bottom of the stack first.
+    */
+    void preload(const std::vector<std::string>& values) {
+      std::string element;
+
+      for (size_t index = 0; index < values.size(); index++) {
+        element.clear();
+        if (!scan_value(values[index], element)) {
+          throw std::string("Invalid input value: " + values[index]);
+        }
+        check_literal(element[0] - '0', element.substr(2));
+        Executor::push_it(element.substr(0, 1), element.substr(2));
+      }
+    }
+
+     void execute_it (const std::vector<std::string>& ParsedProgram) {
+       Executor::load(ParsedProgram);
+       Executor::run(SIZE_MAX);
+     }
+
+     /*
+     * Sets up ParsedProgram to be run by run(), from its first instruction.
+     */
+     void load(const std::vector<std::string>& ParsedProgram) {
+       this->program = &ParsedProgram;
+       if (this->loop_counters.size() != ParsedProgram.size()) {
+         this->loop_counters.resize(ParsedProgram.size());
+       }
+       std::fill(this->loop_counters.begin(), this->loop_counters.end(), 0);
+       this->ip = 0;
+       this->nbr_executed = 0;
+       this->line_nbr = 0;
+     }
+
+     /*
+     * Runs at most budget instructions of the loaded program, from the
+     * instruction pointer where the previous call stopped. Returns true
+     * once the program is finished (exit, or its last instruction).
+     */
+     bool run(size_t budget) {
+       const std::vector<std::string>& ParsedProgram = *this->program;
+       std::vector<std::string> instruction;
+       TraceRecord record = TraceRecord();
+       int opcode = -1;
+       size_t ip = this->ip;
+       size_t executed = 0;
+
+       while(ip < ParsedProgram.size() && executed < budget) {
+         this->line_nbr = ip;
+         this->ip = ip;
+         this->nbr_executed++;
+         executed++;
+         instruction = split_string(ParsedProgram[ip], '-');
+         opcode = -1;
+         if (this->tracer) {
+           record.ip = ip;
+           Executor::trace_operands(record);
+         }
+         ip++;
+         if (!strcmp(instruction[0].c_str(), "push")) {
+           opcode = OP_PUSH;
+           this->stack_container.push(this->constants->get(std::stoi(instruction[1])));
+         }
+         else if (!strcmp(instruction[0].c_str(), "pop")) {
+           opcode = OP_POP;
+           Executor::pop_it();
+         }
+         else if (!strcmp(instruction[0].c_str(), "dump")) {
+           opcode = OP_DUMP;
+           Executor::dump_it();
+         }
+         else if (!strcmp(instruction[0].c_str(), "assert")) {
+           opcode = OP_ASSERT;
+           Executor::assert_it(this->constants->get(std::stoi(instruction[1])),
+                               this->stack_container.top());
+         }
+         else if (!strcmp(instruction[0].c_str(), "add")) {
+           opcode = OP_ADD;
+           IOperand *v1 = this->stack_container.top();
+           IOperand *v2 = this->stack_container.below_top();
+
+           Executor::replace_top(2, *v2 + *v1);
+         }
+         else if (!strcmp(instruction[0].c_str(), "sub")) {
+           opcode = OP_SUB;
+           IOperand *v1 = this->stack_container.top();
+           IOperand *v2 = this->stack_container.below_top();
+
+           Executor::replace_top(2, *v2 - *v1);
+         }
+         else if (!strcmp(instruction[0].c_str(), "mul")) {
+           opcode = OP_MUL;
+           IOperand *v1 = this->stack_container.top();
+           IOperand *v2 = this->stack_container.below_top();
+
+           Executor::replace_top(2, *v2 * *v1);
+         }
+         else if (!strcmp(instruction[0].c_str(), "div")) {
+           opcode = OP_DIV;
+           IOperand *v1 = this->stack_container.top();
+           if (is_zero_divisor(v1)) {
+             throw std::string("Division by zero."); 
+           }
+           IOperand *v2 = this->stack_container.below_top();
+
+           Executor::replace_top(2, *v2 / *v1);
+         }
+         else if (!strcmp(instruction[0].c_str(), "mod")) {
+           opcode = OP_MOD;
+           IOperand *v1 = this->stack_container.top();
+           if (is_zero_divisor(v1)) {
+             throw std::string("Mod division by zero.");
+           }
+           IOperand *v2 = this->stack_container.below_top();
+
+           Executor::replace_top(2, *v2 % *v1);
+         }
+         else if (!strcmp(instruction[0].c_str(), "print")) {
+           opcode = OP_PRINT;
+           Executor::print_it(this->stack_container.top());
+         }
+         else if (!strcmp(instruction[0].c_str(), "sum")  ||
+                  !strcmp(instruction[0].c_str(), "prod") ||
+                  !strcmp(instruction[0].c_str(), "min")  ||
+                  !strcmp(instruction[0].c_str(), "max")) {
+           opcode = (instruction[0][0] == 's') ? OP_SUM :
+                    (instruction[0][0] == 'p') ? OP_PROD :
+                    (instruction[0][1] == 'i') ? OP_MIN : OP_MAX;
+           Executor::reduce_it(opcode, std::stoi(instruction[1]));
+         }
+         else if (!strcmp(instruction[0].c_str(), "label")) {
+           opcode = OP_LABEL;
+         }
+         else if (!strcmp(instruction[0].c_str(), "jmp")) {
+           opcode = OP_JMP;
+           ip = std::stoi(instruction[1]);
+         }
+         else if (!strcmp(instruction[0].c_str(), "jz")) {
+           opcode = OP_JZ;
+           if (Executor::pop_is_zero()) {
+             ip = std::stoi(instruction[1]);
+           }
+         }
+         else if (!strcmp(instruction[0].c_str(), "jnz")) {
+           opcode = OP_JNZ;
+           if (!Executor::pop_is_zero()) {
+             ip = std::stoi(instruction[1]);
+           }
+         }
+         else if (!strcmp(instruction[0].c_str(), "loop")) {
+           opcode = OP_LOOP;
+           if (++this->loop_counters[ip - 1] < std::stoi(instruction[2])) {
+             ip = std::stoi(instruction[1]);
+           }
+           else {
+             this->loop_counters[ip - 1] = 0;
+           }
+         }
+         else if (!strcmp(instruction[0].c_str(), "exit")) {
+           opcode = OP_EXIT;
+           ip = ParsedProgram.size();
+           break;
+         }
+         if (this->tracer && opcode != -1) {
+           record.opcode = opcode;
+           Executor::trace_result(record);
+         }
+       }
+       this->ip = ip;
+       return ip >= ParsedProgram.size();
+     }
+
+     uint64_t getNbrExecuted() {
+       return this->nbr_executed;
+     }
+     
+     /*
+     * sum/prod/min/max N: replaces the N elements on top of the stack by
+     * their reduction.
+     */
+     void reduce_it(int opcode, int count) {
+       IOperand *result = reduce(opcode, this->stack_container.top_slots(count), count);
+
+       Executor::replace_top(count, result);
+     }
+
+     /*
+     * Reduces window[0..count) (window[count - 1] is the top of the stack).
+     * When every element shares an integer type, native values are gathered
+     * in a contiguous buffer and reduced by a vectorizable kernel; the result
+     * wraps like a chain of add/mul would. min/max do the same for any
+     * shared type. Mixed types, and float/double sum/prod (whose add chain
+     * reads each intermediate result back from its string), run the same
+     * chain of Operand operations as N - 1 add/mul instructions.
+     */
+     IOperand *reduce(int opcode, IOperand * const *window, int count) {
+       eOperandType type = window[0]->getType();
+       eOperandType highest = type;
+       bool same_type = true;
+
+       for (int index = 1; index < count; index++) {
+         if (window[index]->getType() != type) {
+           same_type = false;
+         }
+         if (window[index]->getType() > highest) {
+           highest = window[index]->getType();
+         }
+       }
+
+       if (opcode == OP_MIN || opcode == OP_MAX) {
+         double value = same_type ? reduce_same_type(opcode, window, count, type)
+                                  : operand_value(window[0]);
+         int found = 0;
+
+         for (int index = 0; index < count; index++) {
+           double current = operand_value(window[index]);
+           if (same_type ? current == value
+                         : (opcode == OP_MIN ? current < value : current > value)) {
+             value = current;
+             found = index;
+             if (same_type) {
+               break;
+             }
+           }
+         }
+         if (window[found]->getType() == highest) {
+           return window[found];
+         }
+         if (highest <= Int32) {
+           return create_int_operand(highest, static_cast<int32_t>(value));
+         }
+         if (highest == Float) {
+           return new Operand<float>(Float, value, std::to_string(static_cast<float>(value)));
+         }
+         return new Operand<double>(Double, value, std::to_string(value));
+       }
+
+       if (same_type && type <= Int32) {
+         return create_int_operand(type, static_cast<int32_t>(
+                  reduce_same_type(opcode, window, count, type)));
+       }
+
+       IOperand *result = window[count - 1];
+       for (int index = count - 2; index >= 0; index--) {
+         IOperand *next = (opcode == OP_SUM) ? *window[index] + *result
+                                             : *window[index] * *result;
+         if (index < count - 2) {
+           release(result);
+         }
+         result = next;
+       }
+       return result;
+     }
+
+     /*
+     * Integers are summed and multiplied as unsigned, which wraps like the
+     * Operand operations do.
+     */
+     template<typename T>
+     static T reduce_kernel(int opcode, const T *values, int count) {
+       typedef typename wrapping<T>::type U;
+       U acc = (opcode == OP_PROD) ? 1 : 0;
+       T result = values[0];
+
+       if (opcode == OP_SUM) {
+         for (int index = 0; index < count; index++) {
+           acc += static_cast<U>(values[index]);
+         }
+         result = static_cast<T>(acc);
+       }
+       else if (opcode == OP_PROD) {
+         for (int index = 0; index < count; index++) {
+           acc *= static_cast<U>(values[index]);
+         }
+         result = static_cast<T>(acc);
+       }
+       else if (opcode == OP_MIN) {
+         for (int index = 1; index < count; index++) {
+           result = values[index] < result ? values[index] : result;
+         }
+       }
+       else {
+         for (int index = 1; index < count; index++) {
+           result = values[index] > result ? values[index] : result;
+         }
+       }
+       return result;
+     }
+
+     template<typename T>
+     double gather_and_reduce(int opcode, IOperand * const *window, int count) {
+       std::vector<T>& values = scratch<T>();
+
+       values.resize(count);
+       for (int index = 0; index < count; index++) {
+         values[index] = static_cast<const Operand<T> *>(window[index])->getValue();
+       }
+       return reduce_kernel<T>(opcode, &values[0], count);
+     }
+
+     double reduce_same_type(int opcode, IOperand * const *window, int count, eOperandType type) {
+       switch(type) {
+         case(Int8):
+           return gather_and_reduce<int8_t>(opcode, window, count);
+         case(Int16):
+           return gather_and_reduce<int16_t>(opcode, window, count);
+         case(Int32):
+           return gather_and_reduce<int32_t>(opcode, window, count);
+         case(Float):
+           return gather_and_reduce<float>(opcode, window, count);
+         default:
+           return gather_and_reduce<double>(opcode, window, count);
+       }
+     }
+
+     /*
+     * Per-Executor buffers reused by the reduction kernels.
+     */
+     template<typename T>
+     std::vector<T>& scratch() {
+       return std::get<std::vector<T> >(this->scratch_buffers);
+     }
+
+     bool pop_is_zero() {
+       bool is_zero = std::stod(this->stack_container.top()->toString()) == 0;
+
+       Executor::pop_it();
+       return is_zero;
+     }
+
+     static bool is_zero_divisor(const IOperand *divisor) {
+       return std::stoull(divisor->toString()) == 0 ||
+              std::stof(divisor->toString()) == 0 ||
+              std::stod(divisor->toString()) == 0;
+     }
+
+     /*
+     * Runs a program translated by RegisterCompiler: operands live in
+     * registers (one per stack slot) instead of being popped and pushed.
+     */
+     void execute_registers(const RegisterProgram& program) {
+       std::vector<IOperand *>& regs = this->registers;
+       std::vector<int> loop_counters(program.nbr_loops, 0);
+       size_t ip = 0;
+       this->line_nbr = 0;
+
+       Executor::reset();
+       regs.assign(program.nbr_registers + 1, NULL);
+       while (ip < program.code.size()) {
+         const RegInstruction& ins = program.code[ip];
+         this->line_nbr = ins.line;
+         ip++;
+         switch(ins.op) {
+           case(OP_PUSH):
+             Executor::consume_register(ins.dst, NULL);
+             regs[ins.dst] = this->constants->get(ins.arg);
+             break;
+           case(OP_DIV):
+           case(OP_MOD):
+             if (is_zero_divisor(regs[ins.rhs])) {
+               throw std::string(ins.op == OP_DIV ? "Division by zero." : "Mod division by zero.");
+             }
+             /* fall through */
+           case(OP_ADD):
+           case(OP_SUB):
+           case(OP_MUL): {
+             IOperand *result = register_operation(ins, regs[ins.lhs], regs[ins.rhs]);
+             Executor::consume_register(ins.lhs, result);
+             Executor::consume_register(ins.rhs, result);
+             regs[ins.dst] = result;
+             break;
+           }
+           case(OP_SUM):
+           case(OP_PROD):
+           case(OP_MIN):
+           case(OP_MAX): {
+             IOperand *result = reduce(ins.op, &regs[ins.lhs], ins.rhs);
+             for (int reg = ins.lhs; reg < ins.lhs + ins.rhs; reg++) {
+               Executor::consume_register(reg, result);
+             }
+             regs[ins.dst] = result;
+             break;
+           }
+           case(OP_DUMP):
+             for (int reg = ins.lhs - 1; reg >= 0; reg--) {
+               *this->out << regs[reg]->toString() << std::endl;
+             }
+             break;
+           case(OP_ASSERT):
+             Executor::assert_it(this->constants->get(ins.arg), regs[ins.lhs]);
+             break;
+           case(OP_PRINT):
+             Executor::print_it(regs[ins.lhs]);
+             break;
+           case(OP_JMP):
+             ip = ins.arg;
+             break;
+           case(OP_JZ):
+             if (std::stod(regs[ins.lhs]->toString()) == 0) {
+               ip = ins.arg;
+             }
+             Executor::consume_register(ins.lhs, NULL);
+             break;
+           case(OP_JNZ):
+             if (std::stod(regs[ins.lhs]->toString()) != 0) {
+               ip = ins.arg;
+             }
+             Executor::consume_register(ins.lhs, NULL);
+             break;
+           case(OP_LOOP):
+             if (++loop_counters[ins.lhs] < ins.rhs) {
+               ip = ins.arg;
+             }
+             else {
+               loop_counters[ins.lhs] = 0;
+             }
+             break;
+           case(OP_EXIT):
+             return;
+         }
+       }
+     }
+
+     /*
+     * A register read by an operation (or dropped by a push over it) no
+     * longer holds a value of the stack: its operand is freed, unless it
+     * is the result being stored. Each operand is held by one register.
+     */
+     void consume_register(int reg, const IOperand *result) {
+       if (this->registers[reg] != result) {
+         release(this->registers[reg]);
+       }
+       this->registers[reg] = NULL;
+     }
+
+     /*
+     * Like Operand, a rhs of a lower type is read back from its string at
+     * the result type: literals out of range of their own type (int8(300))
+     * keep their string, not their wrapped native value.
+     */
+     static int64_t int_rhs(int type, const IOperand *rhs) {
+       if (rhs->getType() == type) {
+         return static_cast<int64_t>(operand_value(rhs));
+       }
+       switch(type) {
+         case(Int8):
+           return static_cast<int8_t>(std::stoull(rhs->toString()));
+         case(Int16):
+           return static_cast<int16_t>(std::stoull(rhs->toString()));
+         default:
+           return static_cast<int32_t>(std::stoull(rhs->toString()));
+       }
+     }
+
+     /*
+     * Integer typed operations compute on native values; the result is the
+     * same as Operand's, which reads integer rhs back from its string.
+     * Other operations go through Operand.
+     */
+     static IOperand *register_operation(const RegInstruction& ins,
+                                         const IOperand *lhs, const IOperand *rhs) {
+       if (ins.type <= Int32) {
+         int64_t a = static_cast<int64_t>(operand_value(lhs));
+         int64_t b = int_rhs(ins.type, rhs);
+         int64_t result = 0;
+
+         switch(ins.op) {
+           case(OP_ADD):
+             result = a + b;
+             break;
+           case(OP_SUB):
+             result = a - b;
+             break;
+           case(OP_MUL):
+             result = a * b;
+             break;
+           case(OP_DIV):
+             result = a / b;
+             break;
+           case(OP_MOD):
+             result = a % b;
+             break;
+         }
+         switch(ins.type) {
+           case(Int8):
+             return create_int_operand(Int8, static_cast<int8_t>(result));
+           case(Int16):
+             return create_int_operand(Int16, static_cast<int16_t>(result));
+           default:
+             return create_int_operand(Int32, static_cast<int32_t>(result));
+         }
+       }
+       switch(ins.op) {
+         case(OP_ADD):
+           return *lhs + *rhs;
+         case(OP_SUB):
+           return *lhs - *rhs;
+         case(OP_MUL):
+           return *lhs * *rhs;
+         case(OP_DIV):
+           return *lhs / *rhs;
+         default:
+           return *lhs % *rhs;
+       }
+     }
+
+     void push_it (const std::string s_type, 
+                   const std::string s_value) {
+       IOperand *element = NULL;
+       eOperandType type = mapType(s_type);
+
+       element = factory.createOperand(type, s_value);
+       this->stack_container.push(element);
+     }
+     
+     void pop_it() {
+       release(this->stack_container.top());
+       this->stack_container.pop();
+     }
+
+     void dump_it() {
+       std::stack<IOperand *, std::vector<IOperand *> > copy_of_stack = this->stack_container;
+       while (!copy_of_stack.empty()) {
+         *this->out << copy_of_stack.top()->toString() << std::endl;
+         copy_of_stack.pop();
+       }
+     }
+
+     void assert_it (const IOperand *assert_element, const IOperand *top) {
+       eOperandType type = assert_element->getType();
+       try {
+         if (type != top->getType()) {
+           throw "Not same type!";
+         }
+         if (type < 3) {
+           if (std::stoull(assert_element->toString()) != 
+               std::stoull(top->toString())) {
+             throw "Not same value!";
+           }
+         }
+         else if (type == Float) {
+           if (std::stof(assert_element->toString()) != 
+               std::stof(top->toString())) {
+             throw "Not same value!";
+           }
+         }
+         else if (type == Double) {
+           if (std::stod(assert_element->toString()) != 
+               std::stod(top->toString())) {
+             throw "Not same value!";
+           }
+         }
+       }
+       catch(const char *e) {
+         *this->out << e << std::endl;
+       }
+     }
+
+     void print_it (const IOperand *top) {
+       if (top->getType() == Int8) {
+         *this->out << (char)std::stoi(top->toString()) << std::endl;
+       }  
+     }
+
+    ~Executor() {
+      reset();
+    }
+
+     int getLineNbr() {
+       return this->line_nbr;
+     }
+};
+
+/*
+* Work-stealing pool: the range [0, nbr_items) is cut into shards dealt
+* round-robin to one deque per worker. A worker takes shards from the back
+* of its own deque, and steals from the front of the others once it is empty.
+*/
+class ShardPool {
+  private:
+    struct Worker {
+      std::deque<std::pair<size_t, size_t> > shards;
+      std::mutex lock;
+    };
+
+    std::vector<Worker> workers;
+
+    bool take(size_t id, std::pair<size_t, size_t>& shard) {
+      {
+        std::lock_guard<std::mutex> guard(this->workers[id].lock);
+        if (!this->workers[id].shards.empty()) {
+          shard = this->workers[id].shards.back();
+          this->workers[id].shards.pop_back();
+          return true;
+        }
+      }
+      for (size_t offset = 1; offset < this->workers.size(); offset++) {
+        Worker& victim = this->workers[(id + offset) % this->workers.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.shards.empty()) {
+          shard = victim.shards.front();
+          victim.shards.pop_front();
+          return true;
+        }
+      }
+      return false;
+    }
+
+  public:
+    ShardPool(size_t nbr_workers) : workers(nbr_workers ? nbr_workers : 1) {}
+
+    /*
+    * Runs job(worker_id, shard_id, begin, end) over every shard and returns
+    * once all of them are done. Callers size per-shard results beforehand
+    * with nbr_shards().
+    */
+    template<typename Job>
+    void run(size_t nbr_items, size_t shard_size, Job job) {
+      std::vector<std::thread> threads;
+      size_t shard_id = 0;
+
+      for (size_t begin = 0; begin < nbr_items; begin += shard_size, shard_id++) {
+        size_t end = std::min(begin + shard_size, nbr_items);
+        this->workers[shard_id % this->workers.size()].shards.push_front(std::make_pair(begin, end));
+      }
+
+      for (size_t id = 0; id < this->workers.size(); id++) {
+        threads.push_back(std::thread([this, id, shard_size, &job]() {
+          std::pair<size_t, size_t> shard;
+          while (take(id, shard)) {
+            job(id, shard.first / shard_size, shard.first, shard.second);
+          }
+        }));
+      }
+      for (size_t id = 0; id < threads.size(); id++) {
+        threads[id].join();
+      }
+    }
+
+    static size_t nbr_shards(size_t nbr_items, size_t shard_size) {
+      return (nbr_items + shard_size - 1) / shard_size;
+    }
+
+    size_t size() {
+      return this->workers.size();
+    }
+};
+
+//*************************************** 
+/*
+*  BATCH MODE
+*    ./avm [--max-stack N] --batch program.avm input.csv output.txt [threads]
+*
+*  Each line of input.csv holds the initial stack values of one run
+*  (ex: "int32(42),float(1.5)"). The program is lexed and parsed once,
+*  then shared read-only by every worker, each one with its own Executor.
+*  The output of each row is written in input order, followed by ";;".
+*
+****************************************/
+
+std::vector<std::string> split_csv_row(const std::string& line) {
+  std::vector<std::string> values;
+  size_t begin = 0;
+
+  if (line.find_first_not_of(" \t\r") == std::string::npos) {
+    return values;
+  }
+  while (begin <= line.size()) {
+    size_t end = line.find(',', begin);
+    if (end == std::string::npos) {
+      end = line.size();
+    }
+    size_t first = line.find_first_not_of(" \t\r", begin);
+    size_t last  = line.find_last_not_of(" \t\r", end - 1);
+    if (first == std::string::npos || first >= end || last < first) {
+      values.push_back("");
+    }
+    else {
+      values.push_back(line.substr(first, last - first + 1));
+    }
+    begin = end + 1;
+  }
+
+  return values;
+}
+
+int run_batch(int ac, char **av, int max_stack_depth) {
+  std::ifstream p_file(av[2]);
+  std::ifstream input(av[3]);
+  std::vector<std::string> rows;
+  std::string line;
+  Lexer lx;
+  Parser ps;
+  size_t nbr_columns = 0;
+  const size_t shard_size = 256;
+
+  if (!p_file.good() || !input.good()) {
+    std::cout << "Batch mode: cannot open program or input file" << std::endl;
+    return 1;
+  }
+  while (std::getline(input, line)) {
+    rows.push_back(line);
+  }
+  if (!rows.empty()) {
+    nbr_columns = split_csv_row(rows[0]).size();
+  }
+
+  try {
+    lx.lex_it(p_file);
+  }
+  catch(std::string e) {
+    std::cout << "Line " << lx.getLineNbr() << ": Error : " << e << std::endl;
+    return 1;
+  }
+  try {
+    ps.setMaxStackDepth(max_stack_depth);
+    ps.setInitialDepth(nbr_columns);
+    ps.parse_it(lx.getLexedQueue());
+  }
+  catch(std::string e) {
+    std::cout << "Line " << ps.getLineNbr() << ": Error : " << e << std::endl;
+    return 1;
+  }
+
+  const std::vector<std::string> program = ps.getParsedProgram();
+  int64_t nbr_threads = std::thread::hardware_concurrency();
+  if (ac > 5 && !scan_int(av[5], 1, 1024, nbr_threads)) {
+    std::cout << "Batch mode: expected a number of threads between 1 and 1024" << std::endl;
+    return 1;
+  }
+  ShardPool pool(nbr_threads);
+  std::vector<std::string> results(ShardPool::nbr_shards(rows.size(), shard_size));
+  std::vector<Executor> executors(pool.size());
+
+  pool.run(rows.size(), shard_size,
+           [&](size_t worker, size_t shard, size_t begin, size_t end) {
+    std::ostringstream output;
+    Executor& ex = executors[worker];
+
+    ex.setOutput(output);
+    ex.reserve(ps.getMaxDepth());
+    ex.setConstants(ps.getConstants());
+    for (size_t row = begin; row < end; row++) {
+      std::vector<std::string> values = split_csv_row(rows[row]);
+      if (values.size() != nbr_columns) {
+        output << "Row " << (row + 1) << ": Error : " << values.size()
+               << " values, expected " << nbr_columns << std::endl
+               << ";;" << std::endl;
+        continue;
+      }
+      try {
+        ex.preload(values);
+      }
+      catch(std::string e) {
+        output << "Row " << (row + 1) << ": Error : " << e << std::endl
+               << ";;" << std::endl;
+        ex.reset();
+        continue;
+      }
+      try {
+        ex.execute_it(program);
+      }
+      catch(std::string e) {
+        output << "Line " << ex.getLineNbr() << ": Error : " << e << std::endl;
+      }
+      catch(const std::exception& e) {
+        output << "Line " << ex.getLineNbr() << ": Error : " << e.what() << std::endl;
+      }
+      ex.reset();
+      output << ";;" << std::endl;
+    }
+    ex.setOutput(std::cout);
+    results[shard] = output.str();
+  });
+
+  std::ofstream result_file(av[4]);
+  if (!result_file.good()) {
+    std::cout << "Batch mode: cannot open output file" << std::endl;
+    return 1;
+  }
+  for (size_t shard = 0; shard < results.size(); shard++) {
+    result_file << results[shard];
+  }
+
+  return 0;
+}
+
+//*************************************** 
+/*
+*  PERF STATS
+*    ./avm --perf-stats[=json] [programs]
+*
+*  Counts hardware events (Linux perf_event_open) separately for the Lexer,
+*  Parser and Executor phases of each program, with wall time and peak RSS.
+*  Counters that cannot be opened (no PMU, containers, perf_event_paranoid,
+*  other systems) are reported as n/a / null. Stats go to stderr.
+*
+****************************************/
+
+struct PhaseStats {
+  const char *phase;
+  double wall_ms;
+  long peak_rss_kb;
+  bool available[NBR_PERF_COUNTERS];
+  bool scaled[NBR_PERF_COUNTERS];
+  uint64_t counts[NBR_PERF_COUNTERS];
+};
+
+class PerfCounters {
+  private:
+    int fds[NBR_PERF_COUNTERS];
+    std::chrono::steady_clock::time_point start_time;
+
+#ifdef __linux__
+    static int open_counter(uint32_t type, uint64_t config) {
+      struct perf_event_attr attr;
+
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = type;
+      attr.config = config;
+      attr.disabled = 1;
+      attr.exclude_kernel = (type != PERF_TYPE_SOFTWARE);
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+      return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+
+  public:
+    static const char *names[NBR_PERF_COUNTERS];
+
+    PerfCounters() {
+#ifdef __linux__
+      fds[0] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+      fds[1] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+      fds[2] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+      fds[3] = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                                                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+      fds[4] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+      fds[5] = open_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+#else
+      for (int index = 0; index < NBR_PERF_COUNTERS; index++) {
+        fds[index] = -1;
+      }
+#endif
+    }
+
+    void start() {
+#ifdef __linux__
+      for (int index = 0; index < NBR_PERF_COUNTERS; index++) {
+        if (fds[index] != -1) {
+          ioctl(fds[index], PERF_EVENT_IOC_RESET, 0);
+          ioctl(fds[index], PERF_EVENT_IOC_ENABLE, 0);
+        }
+      }
+#endif
+      this->start_time = std::chrono::steady_clock::now();
+    }
+
+    PhaseStats stop(const char *phase) {
+      PhaseStats stats;
+      struct rusage usage;
+
+      stats.phase = phase;
+      stats.wall_ms = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - this->start_time).count();
+      for (int index = 0; index < NBR_PERF_COUNTERS; index++) {
+        stats.available[index] = false;
+        stats.scaled[index] = false;
+        stats.counts[index] = 0;
+#ifdef __linux__
+        // value, time enabled, time running: when the PMU multiplexes the
+        // counters, the count only covers the running time, and is scaled.
+        uint64_t values[3];
+        if (fds[index] != -1) {
+          ioctl(fds[index], PERF_EVENT_IOC_DISABLE, 0);
+          if (read(fds[index], values, sizeof(values)) == sizeof(values) && values[2]) {
+            stats.available[index] = true;
+            stats.counts[index] = values[0];
+            if (values[2] < values[1]) {
+              stats.scaled[index] = true;
+              stats.counts[index] = static_cast<uint64_t>(
+                static_cast<double>(values[0]) * values[1] / values[2]);
+            }
+          }
+        }
+#endif
+      }
+      getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+      stats.peak_rss_kb = usage.ru_maxrss / 1024;
+#else
+      stats.peak_rss_kb = usage.ru_maxrss;
+#endif
+
+      return stats;
+    }
+
+    ~PerfCounters() {
+#ifdef __linux__
+      for (int index = 0; index < NBR_PERF_COUNTERS; index++) {
+        if (fds[index] != -1) {
+          close(fds[index]);
+        }
+      }
+#endif
+    }
+};
+
+const char *PerfCounters::names[NBR_PERF_COUNTERS] = {"cycles",
+                                                      "instructions",
+                                                      "branch_misses",
+                                                      "l1d_misses",
+                                                      "llc_misses",
+                                                      "page_faults"};
+
+void print_perf_stats(const char *program, const std::vector<PhaseStats>& phases, bool json) {
+  if (json) {
+    std::cerr << "{\"program\": \"";
+    for (const char *c = program; *c; c++) {
+      if (*c == '"' || *c == '\\') {
+        std::cerr << '\\' << *c;
+      }
+      else if (*c == '\n') {
+        std::cerr << "\\n";
+      }
+      else if ((unsigned char)*c >= 0x20) {
+        std::cerr << *c;
+      }
+    }
+    std::cerr << "\", \"phases\": [";
+    for (size_t phase = 0; phase < phases.size(); phase++) {
+      std::cerr << (phase ? ", " : "") << "{\"phase\": \"" << phases[phase].phase
+                << "\", \"wall_ms\": " << phases[phase].wall_ms;
+      for (int index = 0; index < NBR_PERF_COUNTERS; index++) {
+        std::cerr << ", \"" << PerfCounters::names[index] << "\": ";
+        if (phases[phase].available[index]) {
+          std::cerr << phases[phase].counts[index];
+        }
+        else {
+          std::cerr << "null";
+        }
+      }
+      std::cerr << ", \"peak_rss_kb\": " << phases[phase].peak_rss_kb << ", \"scaled\": [";
+      bool first = true;
+      for (int index = 0; index < NBR_PERF_COUNTERS; index++) {
+        if (phases[phase].scaled[index]) {
+          std::cerr << (first ? "\"" : ", \"") << PerfCounters::names[index] << "\"";
+          first = false;
+        }
+      }
+      std::cerr << "]}";
+    }
+    std::cerr << "]}" << std::endl;
+    return;
+  }
+
+  std::cerr << "Program: " << program << std::endl;
+  std::cerr << std::left;
+  std::cerr.width(10);
+  std::cerr << "phase";
+  std::cerr.width(12);
+  std::cerr << "wall_ms";
+  for (int index = 0; index < NBR_PERF_COUNTERS; index++) {
+    std::cerr.width(15);
+    std::cerr << PerfCounters::names[index];
+  }
+  std::cerr << "peak_rss_kb" << std::endl;
+  bool scaled = false;
+  for (size_t phase = 0; phase < phases.size(); phase++) {
+    std::cerr.width(10);
+    std::cerr << phases[phase].phase;
+    std::cerr.width(12);
+    std::cerr << phases[phase].wall_ms;
+    for (int index = 0; index < NBR_PERF_COUNTERS; index++) {
+      std::cerr.width(15);
+      if (phases[phase].scaled[index]) {
+        std::cerr << std::to_string(phases[phase].counts[index]) + "*";
+        scaled = true;
+      }
+      else if (phases[phase].available[index]) {
+        std::cerr << phases[phase].counts[index];
+      }
+      else {
+        std::cerr << "n/a";
+      }
+    }
+    std::cerr << phases[phase].peak_rss_kb << std::endl;
+  }
+  if (scaled) {
+    std::cerr << "* multiplexed with other events: scaled from the time it was counting" << std::endl;
+  }
+  std::cerr << std::right;
+}
+
+//*************************************** 
+/*
+*  TRACE REPLAY
+*    ./avm --replay trace.bin [N]
+*
+*  Rebuilds the stack from a trace written with --trace, and prints it as
+*  it was after the Nth executed instruction (the last one by default).
+*
+****************************************/
+
+std::string trace_value(uint8_t type, double value) {
+  const char *types[5] = {"int8", "int16", "int32", "float", "double"};
+  std::string str;
+
+  if (type < Float) {
+    str = std::to_string(static_cast<long long>(value));
+  }
+  else {
+    str = std::to_string(value);
+  }
+  return std::string(types[type]) + "(" + str + ")";
+}
+
+/*
+* A record can only be replayed if its opcode is an instruction, the stack
+* holds the elements it pops, and the value it pushes has an operand type.
+*/
+bool replayable(const TraceRecord& record, size_t depth) {
+  switch(record.opcode) {
+    case(OP_ADD):
+    case(OP_SUB):
+    case(OP_MUL):
+    case(OP_DIV):
+    case(OP_MOD):
+      return depth >= 2 && record.result_type <= Double;
+    case(OP_PUSH):
+    case(OP_SUM):
+    case(OP_PROD):
+    case(OP_MIN):
+    case(OP_MAX):
+      return record.result_type <= Double;
+    case(OP_POP):
+    case(OP_JZ):
+    case(OP_JNZ):
+      return depth >= 1;
+  }
+  return record.opcode < NBR_INSTRUCTIONS;
+}
+
+int run_replay(int ac, char **av) {
+  std::ifstream file(av[2], std::ios::binary);
+  std::vector<std::pair<uint8_t, double> > stack;
+  char magic[8];
+  uint32_t record_size = 0;
+  TraceRecord record;
+  TraceRecord last = {0, 0, TRACE_PROGRAM_START, TRACE_NO_TYPE, TRACE_NO_TYPE, TRACE_NO_TYPE, 0, 0};
+  int64_t target = INT64_MAX;
+  int64_t executed = 0;
+
+  if (ac > 3 && !scan_int(av[3], 0, INT64_MAX, target)) {
+    std::cout << "Replay: expected an instruction number" << std::endl;
+    return 1;
+  }
+
+  file.read(magic, 8);
+  file.read(reinterpret_cast<char *>(&record_size), sizeof(record_size));
+  if (!file.good() || memcmp(magic, TRACE_MAGIC, 8) || record_size != sizeof(TraceRecord)) {
+    std::cout << "Replay: " << av[2] << " is not a trace file" << std::endl;
+    return 1;
+  }
+
+  while (executed <= target &&
+         file.read(reinterpret_cast<char *>(&record), sizeof(TraceRecord))) {
+    if (record.opcode == TRACE_PROGRAM_START) {
+      stack.clear();
+      last = record;
+      continue;
+    }
+    if (!replayable(record, stack.size())) {
+      std::cout << "Replay: " << av[2] << " is not a trace file" << std::endl;
+      return 1;
+    }
+    switch(record.opcode) {
+      case(OP_ADD):
+      case(OP_SUB):
+      case(OP_MUL):
+      case(OP_DIV):
+      case(OP_MOD):
+        stack.pop_back();
+        stack.pop_back();
+        stack.push_back(std::make_pair(record.result_type, record.result));
+        break;
+      case(OP_PUSH):
+        stack.push_back(std::make_pair(record.result_type, record.result));
+        break;
+      case(OP_SUM):
+      case(OP_PROD):
+      case(OP_MIN):
+      case(OP_MAX):
+        if (record.depth == 0 || stack.size() < record.depth) {
+          break;
+        }
+        stack.resize(record.depth - 1);
+        stack.push_back(std::make_pair(record.result_type, record.result));
+        break;
+      case(OP_POP):
+      case(OP_JZ):
+      case(OP_JNZ):
+        stack.pop_back();
+        break;
+    }
+    if (stack.size() != record.depth) {
+      std::cout << "Replay: stack depth mismatch at instruction " << executed << std::endl;
+      return 1;
+    }
+    last = record;
+    executed++;
+  }
+
+  if (last.opcode == TRACE_PROGRAM_START) {
+    std::cout << "Program " << last.ip << ": no instruction executed" << std::endl;
+    return 0;
+  }
+  std::cout << "Instruction " << (executed - 1) << " (line " << last.ip << ", "
+            << instruction_names[last.opcode] << "): " << stack.size()
+            << " elements" << std::endl;
+  for (size_t index = stack.size(); index > 0; index--) {
+    std::cout << trace_value(stack[index - 1].first, stack[index - 1].second) << std::endl;
+  }
+
+  return 0;
+}
+
+//*************************************** 
+/*
+*  C++ EMITTER
+*    ./avm --emit-cpp program.avm [output.cpp]
+*
+*  Writes a self-contained C++ source file running the program natively,
+*  with the same output and errors as the VM. The program goes through the
+*  RegisterCompiler first: registers become a local array, jumps become
+*  gotos, and every value keeps the type, native value and string an
+*  Operand would have, so promotion and string round-trips match exactly.
+*
+****************************************/
+
+const char *cpp_runtime = R"(#include <cstdint>
+#include <iostream>
+#include <string>
+#include <type_traits>
+
+enum { Int8, Int16, Int32, Float, Double };
+enum { Sum, Prod, Min, Max };
+
+struct Value {
+  int type;
+  double value;
+  std::string str;
+};
+
+inline Value int_value(int type, long long value) {
+  return Value{type, static_cast<double>(value), std::to_string(value)};
+}
+
+template<typename T>
+inline T apply(char op, T a, T b) {
+  switch (op) {
+    case '+': return a + b;
+    case '-': return a - b;
+    case '*': return a * b;
+    case '/': return a / b;
+  }
+  if constexpr (std::is_integral<T>::value) {
+    return a % b;
+  }
+  return a;
+}
+
+// Same as Operand: lhs is used natively, rhs is read back from its string.
+inline Value operate(char op, const Value& l, const Value& r) {
+  switch (l.type >= r.type ? l.type : r.type) {
+    case Int8:
+      return int_value(Int8, apply<int8_t>(op, static_cast<int8_t>(l.value),
+                                           static_cast<int8_t>(std::stoull(r.str))));
+    case Int16:
+      return int_value(Int16, apply<int16_t>(op, static_cast<int16_t>(l.value),
+                                             static_cast<int16_t>(std::stoull(r.str))));
+    case Int32:
+      return int_value(Int32, apply<int32_t>(op, static_cast<int32_t>(l.value),
+                                             static_cast<int32_t>(std::stoull(r.str))));
+    case Float: {
+      float v = (op == '%')
+        ? static_cast<float>(static_cast<int32_t>(l.value) % static_cast<int32_t>(std::stoull(r.str)))
+        : apply<float>(op, static_cast<float>(l.value), std::stof(r.str));
+      return Value{Float, v, std::to_string(v)};
+    }
+    default: {
+      double v = (op == '%')
+        ? static_cast<double>(static_cast<int32_t>(l.value) % static_cast<int32_t>(std::stoull(r.str)))
+        : apply<double>(op, l.value, std::stod(r.str));
+      return Value{Double, v, std::to_string(v)};
+    }
+  }
+}
+
+// Operation whose operand types are known to be integers. Like operate(),
+// a rhs of a lower type is read back from its string.
+template<typename T>
+inline Value int_operate(int type, char op, const Value& l, const Value& r) {
+  T rhs = (r.type == type) ? static_cast<T>(r.value) : static_cast<T>(std::stoull(r.str));
+  return int_value(type, apply<T>(op, static_cast<T>(l.value), rhs));
+}
+
+inline bool zero_divisor(const Value& v) {
+  return std::stoull(v.str) == 0 || std::stof(v.str) == 0 || std::stod(v.str) == 0;
+}
+
+template<typename T>
+inline Value wrap_reduce(int type, int op, const Value *w, int n) {
+  typedef typename std::make_unsigned<T>::type U;
+  U acc = (op == Prod) ? 1 : 0;
+
+  for (int i = 0; i < n; i++) {
+    acc = (op == Prod) ? acc * static_cast<U>(static_cast<T>(w[i].value))
+                       : acc + static_cast<U>(static_cast<T>(w[i].value));
+  }
+  return int_value(type, static_cast<T>(acc));
+}
+
+inline Value reduce(int op, const Value *w, int n) {
+  int highest = w[0].type;
+  bool same_type = true;
+
+  for (int i = 1; i < n; i++) {
+    same_type = same_type && w[i].type == w[0].type;
+    highest = w[i].type > highest ? w[i].type : highest;
+  }
+  if (op == Min || op == Max) {
+    int found = 0;
+    for (int i = 1; i < n; i++) {
+      if (op == Min ? w[i].value < w[found].value : w[i].value > w[found].value) {
+        found = i;
+      }
+    }
+    if (w[found].type == highest) {
+      return w[found];
+    }
+    if (highest <= Int32) {
+      return int_value(highest, static_cast<int32_t>(w[found].value));
+    }
+    if (highest == Float) {
+      float v = static_cast<float>(w[found].value);
+      return Value{Float, v, std::to_string(v)};
+    }
+    return Value{Double, w[found].value, std::to_string(w[found].value)};
+  }
+  if (same_type && highest == Int8) {
+    return wrap_reduce<int8_t>(Int8, op, w, n);
+  }
+  if (same_type && highest == Int16) {
+    return wrap_reduce<int16_t>(Int16, op, w, n);
+  }
+  if (same_type && highest == Int32) {
+    return wrap_reduce<int32_t>(Int32, op, w, n);
+  }
+  Value result = w[n - 1];
+  for (int i = n - 2; i >= 0; i--) {
+    result = operate(op == Sum ? '+' : '*', w[i], result);
+  }
+  return result;
+}
 
-           this->stack_container.push(*v2 % *v1);
-         }
-         else if (!strcmp(instruction[0].c_str(), "print")) {
-           Executor::print_it();
-         }
-         ParsedQueue.pop();
-       }
-     }
-     
-     void push_it (const std::string s_type, 
-                   const std::string s_value) {
-       IOperand *element = NULL;
-       eOperandType type = mapType(s_type);
+inline void dump(const Value *r, int n) {
+  for (int i = n - 1; i >= 0; i--) {
+    std::cout << r[i].str << '\n';
+  }
+}
 
-       element = factory.createOperand(type, s_value);
-       this->stack_container.push(element);
-     }
-     
-     void pop_it() {
-       this->stack_container.pop();
-     }
+inline void assert_value(const Value& expected, const Value& top) {
+  if (expected.type != top.type) {
+    std::cout << "Not same type!" << '\n';
+  }
+  else if ((expected.type < Float && std::stoull(expected.str) != std::stoull(top.str)) ||
+           (expected.type == Float && std::stof(expected.str) != std::stof(top.str)) ||
+           (expected.type == Double && std::stod(expected.str) != std::stod(top.str))) {
+    std::cout << "Not same value!" << '\n';
+  }
+}
 
-     void dump_it() {
-       std::stack<IOperand *> copy_of_stack = this->stack_container;
-       while (!copy_of_stack.empty()) {
-         std::cout << copy_of_stack.top()->toString() << std::endl;
-         copy_of_stack.pop();
-       }
-     }
+inline void print(const Value& top) {
+  if (top.type == Int8) {
+    std::cout << static_cast<char>(std::stoi(top.str)) << '\n';
+  }
+}
 
-     void assert_it (const std::string s_type, 
-                   const std::string s_value) {
-       eOperandType type = mapType(s_type);
-       IOperand *assert_element = factory.createOperand(type, s_value);
-       try {
-         if (type != this->stack_container.top()->getType()) {
-           throw "Not same type!";
-         }
-         if (type < 3) {
-           if (std::stoull(assert_element->toString()) != 
-               std::stoull(this->stack_container.top()->toString())) {
-             throw "Not same value!";
-           }
-         }
-         else if (type == Float) {
-           if (std::stof(assert_element->toString()) != 
-               std::stof(this->stack_container.top()->toString())) {
-             throw "Not same value!";
-           }
-         }
-         else if (type == Double) {
-           if (std::stod(assert_element->toString()) != 
-               std::stod(this->stack_container.top()->toString())) {
-             throw "Not same value!";
-           }
-         }
-       }
-       catch(const char *e) {
-         std::cout << e << std::endl;
-       }
-     }
+inline int fail(int line, const char *message) {
+  std::cout << "Line " << line << ": Error : " << message << std::endl;
+  return 0;
+}
+)";
 
-     void print_it () {
-       if (this->stack_container.top()->getType() == Int8) {
-         std::cout << (char)std::stoi(this->stack_container.top()->toString()) << std::endl;
-       }  
-     }
+/*
+* C++ string literal for s (program literals and source names).
+*/
+std::string cpp_string(const std::string& s) {
+  std::string literal = "\"";
+
+  for (size_t index = 0; index < s.size(); index++) {
+    if (s[index] == '"' || s[index] == '\\') {
+      literal += '\\';
+      literal += s[index];
+    }
+    else if (s[index] == '\n') {
+      literal += "\\n";
+    }
+    else {
+      literal += s[index];
+    }
+  }
+  return literal + "\"";
+}
 
-    ~Executor() {}
+void emit_cpp(std::ostream& out, const RegisterProgram& program,
+              const ConstantPool& constants, const std::string& source) {
+  const char *type_names[5] = {"Int8", "Int16", "Int32", "Float", "Double"};
+  const char *int_types[3] = {"int8_t", "int16_t", "int32_t"};
+  const char *reductions[4] = {"Sum", "Prod", "Min", "Max"};
+  const char op_chars[5] = {'+', '-', '*', '/', '%'};
+  std::vector<bool> is_target(program.code.size() + 1, false);
+
+  for (size_t index = 0; index < program.code.size(); index++) {
+    const RegInstruction& ins = program.code[index];
+    if (ins.op == OP_JMP || ins.op == OP_JZ || ins.op == OP_JNZ || ins.op == OP_LOOP) {
+      is_target[ins.arg] = true;
+    }
+  }
 
-     int getLineNbr() {
-       return this->line_nbr;
-     }
+  out << "// Generated by avm --emit-cpp from " << source.substr(0, source.find('\n')) << std::endl;
+  out << cpp_runtime << std::endl;
+
+  out << "static const Value K[] = {" << std::endl << std::hexfloat;
+  for (size_t index = 0; index < constants.size(); index++) {
+    const IOperand *constant = constants.get(index);
+    out << "  {" << type_names[constant->getType()] << ", " << operand_value(constant)
+        << ", " << cpp_string(constant->toString()) << "}," << std::endl;
+  }
+  out << std::defaultfloat << "  {Int8, 0, \"0\"}" << std::endl << "};" << std::endl << std::endl;
+
+  out << "int main() {" << std::endl;
+  out << "  static Value r[" << program.nbr_registers + 1 << "];" << std::endl;
+  out << "  int loops[" << program.nbr_loops + 1 << "] = {0};" << std::endl << std::endl;
+  out << "  (void)r;" << std::endl << "  (void)loops;" << std::endl;
+
+  for (size_t index = 0; index <= program.code.size(); index++) {
+    if (is_target[index]) {
+      out << "L" << index << ":" << std::endl;
+    }
+    if (index == program.code.size()) {
+      break;
+    }
+    const RegInstruction& ins = program.code[index];
+    out << "  ";
+    switch(ins.op) {
+      case(OP_PUSH):
+        out << "r[" << ins.dst << "] = K[" << ins.arg << "];";
+        break;
+      case(OP_ADD):
+      case(OP_SUB):
+      case(OP_MUL):
+      case(OP_DIV):
+      case(OP_MOD):
+        if (ins.op == OP_DIV || ins.op == OP_MOD) {
+          out << "if (zero_divisor(r[" << ins.rhs << "])) return fail(" << ins.line << ", \""
+              << (ins.op == OP_DIV ? "Division by zero." : "Mod division by zero.") << "\");"
+              << std::endl << "  ";
+        }
+        out << "r[" << ins.dst << "] = ";
+        if (ins.type <= Int32) {
+          out << "int_operate<" << int_types[ins.type] << ">(" << type_names[ins.type] << ", ";
+        }
+        else {
+          out << "operate(";
+        }
+        out << "'" << op_chars[ins.op - OP_ADD] << "', r[" << ins.lhs << "], r[" << ins.rhs << "]);";
+        break;
+      case(OP_SUM):
+      case(OP_PROD):
+      case(OP_MIN):
+      case(OP_MAX):
+        out << "r[" << ins.dst << "] = reduce(" << reductions[ins.op - OP_SUM] << ", &r["
+            << ins.lhs << "], " << ins.rhs << ");";
+        break;
+      case(OP_DUMP):
+        out << "dump(r, " << ins.lhs << ");";
+        break;
+      case(OP_ASSERT):
+        out << "assert_value(K[" << ins.arg << "], r[" << ins.lhs << "]);";
+        break;
+      case(OP_PRINT):
+        out << "print(r[" << ins.lhs << "]);";
+        break;
+      case(OP_JMP):
+        out << "goto L" << ins.arg << ";";
+        break;
+      case(OP_JZ):
+        out << "if (std::stod(r[" << ins.lhs << "].str) == 0) goto L" << ins.arg << ";";
+        break;
+      case(OP_JNZ):
+        out << "if (std::stod(r[" << ins.lhs << "].str) != 0) goto L" << ins.arg << ";";
+        break;
+      case(OP_LOOP):
+        out << "if (++loops[" << ins.lhs << "] < " << ins.rhs << ") goto L" << ins.arg << ";"
+            << " else loops[" << ins.lhs << "] = 0;";
+        break;
+      case(OP_EXIT):
+        out << "return 0;";
+        break;
+    }
+    out << " // line " << ins.line << std::endl;
+  }
+  out << "  return 0;" << std::endl << "}" << std::endl;
+}
+
+int run_emit_cpp(int ac, char **av, int max_stack_depth) {
+  struct stat buf;
+  Lexer lx;
+  Parser ps;
+  std::string source(av[2]);
+
+  try {
+    if (!stat(av[2], &buf)) {
+      std::ifstream p_file(av[2]);
+      lx.lex_it(p_file);
+    }
+    else {
+      lx.lex_it(source);
+    }
+  }
+  catch(std::string e) {
+    std::cerr << "Line " << lx.getLineNbr() << ": Error : " << e << std::endl;
+    return 1;
+  }
+  try {
+    ps.setMaxStackDepth(max_stack_depth);
+    ps.parse_it(lx.getLexedQueue());
+  }
+  catch(std::string e) {
+    std::cerr << "Line " << ps.getLineNbr() << ": Error : " << e << std::endl;
+    return 1;
+  }
+
+  RegisterCompiler compiler(ps.getParsedProgram(), ps.getSimulatedDepths(), ps.getConstants());
+  RegisterProgram program = compiler.compile(ps.getMaxDepth());
+
+  if (ac > 3) {
+    std::ofstream output(av[3]);
+    if (!output.good()) {
+      std::cerr << "Cannot open " << av[3] << std::endl;
+      return 1;
+    }
+    emit_cpp(output, program, ps.getConstants(), source);
+  }
+  else {
+    emit_cpp(std::cout, program, ps.getConstants(), source);
+  }
+
+  return 0;
+}
+
+//*************************************** 
+/*
+*  SCHEDULE MODE
+*    ./avm --schedule [--budget N] [--threads T] [--timeout MS] [programs]
+*
+*  Runs every program (file or instructions) on its own Executor, interleaved
+*  on T threads (one per core by default) by slices of N instructions
+*  (1000 by default). Programs still running MS milliseconds after the start
+*  are stopped, and SIGINT cancels the ones not finished yet. The output of
+*  each program is printed in argument order, and a report of each VM
+*  (state, instructions, slices, run time, longest wait in the run queue
+*  and finish time) goes to stderr.
+*
+****************************************/
+
+/*
+* Cooperative scheduler: runs many loaded Executors on a few threads. A VM
+* runs for a slice of at most budget instructions, then goes back to the end
+* of the run queue, so every runnable VM gets a slice in turn, and a long
+* program cannot hold a thread while short ones wait behind it.
+*/
+class Scheduler {
+  public:
+    enum eState {
+      RUNNABLE,
+      DONE,
+      FAILED,
+      TIMED_OUT,
+      CANCELLED
+    };
+
+    struct Task {
+      Executor *ex;
+      eState state;
+      std::string error;
+      uint64_t slices;
+      double run_ms;
+      double max_wait_ms;
+      double finish_ms;
+      std::chrono::steady_clock::time_point queued_at;
+    };
+
+    static const char *state_names[5];
+
+  private:
+    std::deque<Task> tasks;
+    std::deque<Task *> run_queue;
+    std::mutex lock;
+    std::condition_variable wake_up;
+    std::atomic<bool> cancelling;
+    std::chrono::steady_clock::time_point start;
+    size_t nbr_running;
+    size_t budget;
+    double timeout_ms;
+
+    static double elapsed_ms(std::chrono::steady_clock::time_point from,
+                             std::chrono::steady_clock::time_point to) {
+      return std::chrono::duration<double, std::milli>(to - from).count();
+    }
+
+    /*
+    * Cancellation and timeouts take effect between two slices.
+    */
+    bool stopped(Task *task, std::chrono::steady_clock::time_point now) {
+      if (this->cancelling) {
+        task->state = CANCELLED;
+      }
+      else if (this->timeout_ms > 0 && elapsed_ms(this->start, now) > this->timeout_ms) {
+        task->state = TIMED_OUT;
+      }
+      return task->state != RUNNABLE;
+    }
+
+    void run_slice(Task *task) {
+      std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+      task->max_wait_ms = std::max(task->max_wait_ms, elapsed_ms(task->queued_at, begin));
+      if (stopped(task, begin)) {
+        return;
+      }
+      try {
+        if (task->ex->run(this->budget)) {
+          task->state = DONE;
+        }
+      }
+      catch(std::string e) {
+        task->state = FAILED;
+        task->error = "Line " + std::to_string(task->ex->getLineNbr()) + ": Error : " + e;
+      }
+      catch(const std::exception& e) {
+        task->state = FAILED;
+        task->error = "Line " + std::to_string(task->ex->getLineNbr()) + ": Error : " + e.what();
+      }
+      std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+      task->slices++;
+      task->run_ms += elapsed_ms(begin, end);
+      if (task->state == RUNNABLE) {
+        stopped(task, end);
+      }
+    }
+
+    /*
+    * A worker only exits once the queue is empty and no other worker holds
+    * a VM that may still be queued again.
+    */
+    void work() {
+      std::unique_lock<std::mutex> guard(this->lock);
+
+      while (true) {
+        this->wake_up.wait(guard, [this]() {
+          return !this->run_queue.empty() || !this->nbr_running;
+        });
+        if (this->run_queue.empty()) {
+          return;
+        }
+        Task *task = this->run_queue.front();
+        this->run_queue.pop_front();
+        this->nbr_running++;
+        guard.unlock();
+
+        run_slice(task);
+
+        guard.lock();
+        this->nbr_running--;
+        if (task->state == RUNNABLE) {
+          task->queued_at = std::chrono::steady_clock::now();
+          this->run_queue.push_back(task);
+        }
+        else {
+          task->finish_ms = elapsed_ms(this->start, std::chrono::steady_clock::now());
+        }
+        this->wake_up.notify_all();
+      }
+    }
+
+  public:
+    Scheduler(size_t slice_budget, double timeout)
+      : cancelling(false), nbr_running(0), budget(slice_budget ? slice_budget : 1),
+        timeout_ms(timeout) {}
+
+    /*
+    * Adds an Executor with a program already loaded, and returns its id.
+    */
+    size_t add(Executor& ex) {
+      this->tasks.emplace_back();
+      Task& task = this->tasks.back();
+      task.ex = &ex;
+      task.state = RUNNABLE;
+      task.slices = 0;
+      task.run_ms = 0;
+      task.max_wait_ms = 0;
+      task.finish_ms = 0;
+      return this->tasks.size() - 1;
+    }
+
+    const Task& get(size_t id) {
+      return this->tasks[id];
+    }
+
+    /*
+    * Only stores an atomic flag, so it can be called from a signal handler.
+    */
+    void cancel_all() {
+      this->cancelling = true;
+    }
+
+    /*
+    * Runs every VM, in turn, on nbr_threads threads until all of them are
+    * done, failed, timed out or cancelled.
+    */
+    void run(size_t nbr_threads) {
+      std::vector<std::thread> threads;
+
+      this->start = std::chrono::steady_clock::now();
+      for (size_t id = 0; id < this->tasks.size(); id++) {
+        this->tasks[id].queued_at = this->start;
+        this->run_queue.push_back(&this->tasks[id]);
+      }
+      for (size_t id = 0; id < (nbr_threads ? nbr_threads : 1); id++) {
+        threads.push_back(std::thread(&Scheduler::work, this));
+      }
+      for (size_t id = 0; id < threads.size(); id++) {
+        threads[id].join();
+      }
+    }
+
+    size_t size() {
+      return this->tasks.size();
+    }
+};
+
+const char *Scheduler::state_names[5] = {"runnable", "done", "error", "timeout", "cancelled"};
+
+struct ScheduledProgram {
+  std::string name;
+  Lexer lx;
+  Parser ps;
+  Executor ex;
+  std::ostringstream output;
+  std::string error;
+  bool scheduled;
+  size_t id;
 };
 
+Scheduler *active_scheduler = NULL;
+
+void cancel_scheduled(int signal_number) {
+  (void)signal_number;
+  if (active_scheduler) {
+    active_scheduler->cancel_all();
+  }
+}
+
+void print_schedule_report(std::deque<ScheduledProgram>& programs, Scheduler& scheduler) {
+  const char *columns[7] = {"state", "instructions", "slices", "run_ms", "max_wait_ms",
+                            "finish_ms", "program"};
+
+  std::cerr << std::left;
+  for (int index = 0; index < 7; index++) {
+    std::cerr.width(14);
+    std::cerr << columns[index];
+  }
+  std::cerr << std::endl;
+  for (size_t index = 0; index < programs.size(); index++) {
+    std::cerr.width(14);
+    if (!programs[index].scheduled) {
+      std::cerr << Scheduler::state_names[Scheduler::FAILED];
+      for (int column = 1; column < 6; column++) {
+        std::cerr.width(14);
+        std::cerr << 0;
+      }
+    }
+    else {
+      const Scheduler::Task& task = scheduler.get(programs[index].id);
+      std::cerr << Scheduler::state_names[task.state];
+      std::cerr.width(14);
+      std::cerr << programs[index].ex.getNbrExecuted();
+      std::cerr.width(14);
+      std::cerr << task.slices;
+      std::cerr.width(14);
+      std::cerr << task.run_ms;
+      std::cerr.width(14);
+      std::cerr << task.max_wait_ms;
+      std::cerr.width(14);
+      std::cerr << task.finish_ms;
+    }
+    for (size_t c = 0; c < programs[index].name.size(); c++) {
+      if (programs[index].name[c] == '\n') {
+        std::cerr << "\\n";
+      }
+      else {
+        std::cerr << programs[index].name[c];
+      }
+    }
+    std::cerr << std::endl;
+  }
+  std::cerr << std::right;
+}
+
+int run_schedule(int ac, char **av, int max_stack_depth, size_t budget,
+                 size_t nbr_threads, double timeout_ms) {
+  std::deque<ScheduledProgram> programs;
+  Scheduler scheduler(budget, timeout_ms);
+  struct stat buf;
+
+  for (int index = 2; index < ac; index++) {
+    programs.emplace_back();
+    ScheduledProgram& program = programs.back();
+    program.name = av[index];
+    program.scheduled = false;
+    try {
+      if (!stat(av[index], &buf)) {
+        std::ifstream p_file(av[index]);
+        program.lx.lex_it(p_file);
+      }
+      else {
+        program.lx.lex_it(program.name);
+      }
+    }
+    catch(std::string e) {
+      program.error = "Line " + std::to_string(program.lx.getLineNbr()) + ": Error : " + e;
+      continue;
+    }
+    try {
+      program.ps.setMaxStackDepth(max_stack_depth);
+      program.ps.parse_it(program.lx.getLexedQueue());
+    }
+    catch(std::string e) {
+      program.error = "Line " + std::to_string(program.ps.getLineNbr()) + ": Error : " + e;
+      continue;
+    }
+    program.ex.reserve(program.ps.getMaxDepth());
+    program.ex.setConstants(program.ps.getConstants());
+    program.ex.setOutput(program.output);
+    program.ex.load(program.ps.getParsedProgram());
+    program.id = scheduler.add(program.ex);
+    program.scheduled = true;
+  }
+
+  active_scheduler = &scheduler;
+  std::signal(SIGINT, cancel_scheduled);
+  scheduler.run(nbr_threads ? nbr_threads : std::thread::hardware_concurrency());
+  std::signal(SIGINT, SIG_DFL);
+  active_scheduler = NULL;
+
+  for (size_t index = 0; index < programs.size(); index++) {
+    std::cout << programs[index].output.str();
+    if (programs[index].scheduled) {
+      programs[index].error = scheduler.get(programs[index].id).error;
+    }
+    if (!programs[index].error.empty()) {
+      std::cout << programs[index].error << std::endl;
+    }
+  }
+  print_schedule_report(programs, scheduler);
+
+  return 0;
+}
+
 //*************************************** 
 /*
 *  MAIN
 *
 ****************************************/
 
+/*
+* Looks for "name value" in the arguments, and removes both from av,
+* so the remaining arguments are only programs.
+*/
+bool take_option(int& ac, char **av, const char *name, std::string& value) {
+  for (int index = 1; index < ac - 1; index++) {
+    if (!strcmp(av[index], name)) {
+      value = av[index + 1];
+      for (int next = index + 2; next <= ac; next++) {
+        av[next - 2] = av[next];
+      }
+      ac -= 2;
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+* Looks for the flag "name" or "name=value" in the arguments, and removes
+* it from av.
+*/
+bool take_flag(int& ac, char **av, const char *name, std::string& value) {
+  size_t length = strlen(name);
+
+  for (int index = 1; index < ac; index++) {
+    if (!strncmp(av[index], name, length) &&
+        (av[index][length] == '\0' || av[index][length] == '=')) {
+      value = av[index][length] ? av[index] + length + 1 : "";
+      for (int next = index + 1; next <= ac; next++) {
+        av[next - 1] = av[next];
+      }
+      ac -= 1;
+      return true;
+    }
+  }
+  return false;
+}
+
 int main(int ac, char **av) {
+  std::string option;
+  int max_stack_depth = DEFAULT_MAX_STACK_DEPTH;
+  std::unique_ptr<TraceWriter> tracer;
+  std::unique_ptr<PerfCounters> perf;
+  bool perf_json = false;
+  bool register_vm = false;
+  bool print_ir = false;
+  std::vector<PhaseStats> phases;
+
+  if (take_option(ac, av, "--max-stack", option)) {
+    int64_t depth = 0;
+    if (!scan_int(option, 1, INT32_MAX, depth)) {
+      std::cout << "--max-stack: expected a positive number of elements" << std::endl;
+      return 1;
+    }
+    max_stack_depth = depth;
+  }
+  if (take_option(ac, av, "--small-ints", option)) {
+    size_t colon = option.find(':');
+    int64_t first = 0;
+    int64_t last = 0;
+    if (colon == std::string::npos ||
+        !scan_int(std::string_view(option).substr(0, colon), INT32_MIN, INT32_MAX, first) ||
+        !scan_int(std::string_view(option).substr(colon + 1), INT32_MIN, INT32_MAX, last) ||
+        first > last || last - first > MAX_SMALL_INTS) {
+      std::cout << "--small-ints: expected MIN:MAX, with at most "
+                << MAX_SMALL_INTS << " values" << std::endl;
+      return 1;
+    }
+    SmallOperands::setRange(first, last);
+  }
+  if (ac >= 5 && !strcmp(av[1], "--batch")) {
+    return run_batch(ac, av, max_stack_depth);
+  }
+  if (ac >= 3 && !strcmp(av[1], "--replay")) {
+    return run_replay(ac, av);
+  }
+  if (ac >= 3 && !strcmp(av[1], "--emit-cpp")) {
+    return run_emit_cpp(ac, av, max_stack_depth);
+  }
+  if (ac >= 3 && !strcmp(av[1], "--schedule")) {
+    int64_t budget = 1000;
+    int64_t nbr_threads = 0;
+    int64_t timeout_ms = 0;
+    if (take_option(ac, av, "--budget", option) &&
+        !scan_int(option, 1, INT32_MAX, budget)) {
+      std::cout << "--budget: expected a positive number of instructions" << std::endl;
+      return 1;
+    }
+    if (take_option(ac, av, "--threads", option) &&
+        !scan_int(option, 1, 1024, nbr_threads)) {
+      std::cout << "--threads: expected a number of threads between 1 and 1024" << std::endl;
+      return 1;
+    }
+    if (take_option(ac, av, "--timeout", option) &&
+        !scan_int(option, 0, INT32_MAX, timeout_ms)) {
+      std::cout << "--timeout: expected a number of milliseconds (0 for none)" << std::endl;
+      return 1;
+    }
+    return run_schedule(ac, av, max_stack_depth, budget, nbr_threads, timeout_ms);
+  }
+  if (take_option(ac, av, "--trace", option)) {
+    try {
+      tracer.reset(new TraceWriter(option));
+    }
+    catch(std::string e) {
+      std::cout << "Error : " << e << std::endl;
+      return 1;
+    }
+  }
+
+  if (take_flag(ac, av, "--regvm", option)) {
+    if (tracer) {
+      std::cout << "--trace is not supported with --regvm" << std::endl;
+      return 1;
+    }
+    register_vm = true;
+    print_ir = !strcmp(option.c_str(), "ir");
+  }
+  if (take_flag(ac, av, "--perf-stats", option)) {
+    perf.reset(new PerfCounters());
+    perf_json = !strcmp(option.c_str(), "json");
+  }
+
   int *arg_types = check_if_program_file(ac, av);
 
   if (!arg_types || arg_types[0] == NO_PARAMS) {
@@ -885,7 +3897,11 @@ int main(int ac, char **av) {
     //Instantiate objects;
     Lexer lx;
     Parser ps;
+    phases.clear();
     //LEXER
+    if (perf) {
+      perf->start();
+    }
     try {
       if (arg_types[index] == PROGRAM_FILE) {
         std::ifstream p_file;
@@ -902,8 +3918,15 @@ int main(int ac, char **av) {
       std::cout << "Line " << lx.getLineNbr() << ": Error : " << e << std::endl;
       return 1;
     }
+    if (perf) {
+      phases.push_back(perf->stop("lexer"));
+    }
     //PARSER
+    if (perf) {
+      perf->start();
+    }
     try {
+      ps.setMaxStackDepth(max_stack_depth);
       ps.parse_it(lx.getLexedQueue());
     }
     catch(std::string e) {
@@ -911,13 +3934,51 @@ int main(int ac, char **av) {
       return 1;
     }
 
+    if (perf) {
+      phases.push_back(perf->stop("parser"));
+    }
+
     Executor ex;
+    ex.reserve(ps.getMaxDepth());
+    ex.setConstants(ps.getConstants());
+    //REGISTER COMPILER
+    RegisterProgram program;
+    if (register_vm) {
+      if (perf) {
+        perf->start();
+      }
+      RegisterCompiler compiler(ps.getParsedProgram(), ps.getSimulatedDepths(), ps.getConstants());
+      program = compiler.compile(ps.getMaxDepth());
+      if (perf) {
+        phases.push_back(perf->stop("compiler"));
+      }
+      if (print_ir) {
+        RegisterCompiler::print_ir(program);
+      }
+    }
+    //EXECUTOR
+    if (perf) {
+      perf->start();
+    }
+    if (tracer) {
+      tracer->start_program(index);
+      ex.setTrace(tracer.get());
+    }
     try {
-      ex.execute_it(ps.getParsedQueue());
+      if (register_vm) {
+        ex.execute_registers(program);
+      }
+      else {
+        ex.execute_it(ps.getParsedProgram());
+      }
     }
     catch(std::string e) {
       std::cout << "Line " << ex.getLineNbr() << ": Error : " << e << std::endl;
     }
+    if (perf) {
+      phases.push_back(perf->stop("executor"));
+      print_perf_stats(av[index + 1], phases, perf_json);
+    }
    }
 
   return 0;